@@ -17,15 +17,16 @@
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
+#include <linux/seqlock.h>
 #include <linux/spinlock.h>
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
-#include "lunix-lookup.h"
 
 /*
  * Συναρτήσεις:
@@ -59,7 +60,7 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
 	WARN_ON(!(sensor = state->sensor));
 	
 	/* ? --> done */
-	if(state->buf_timestamp != sensor->msr_data[state->type]->last_update)
+	if(state->buf_seq != lunix_sensor_seq(sensor, state->type))
 		return 1;
 
 	return 0;  
@@ -67,6 +68,21 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
 
 
 
+/*
+ * Fills in a binary record for a sample of the measurement
+ */
+static void lunix_chrdev_fill_record(struct lunix_record *rec, struct lunix_chrdev_state_struct *state,
+	const struct lunix_msr_snapshot *snap)
+{
+	rec->seq = snap->seq;
+	rec->timestamp_ns = snap->timestamp_ns;
+	rec->timestamp = snap->timestamp;
+	rec->value = lunix_msr_convert(state->type, snap->value);
+	rec->raw = snap->value;
+	rec->nodeid = state->sensor->nodeid;
+	rec->type = state->type;
+}
+
 /*
  * Updates the cached state of a character device
  * based on sensor data. Must be called with the
@@ -81,30 +97,20 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 	debug("leaving\n"); 
 
 	int type = state->type;
-	uint32_t data;
-	uint32_t timestamp; 
+	struct lunix_msr_snapshot snap;
 
 	/*
-	 * Grab the raw data quickly, hold the
-	 * spinlock for as little as possible.
+	 * Grab the raw data quickly, without locking,
+	 * so that the line discipline is never delayed.
 	 */
-
-	/* ? --> done */
-	spin_lock(&sensor->lock);
-
-	data = sensor->msr_data[type]->values[0];
-	timestamp = sensor->msr_data[type]->last_update;
-
-	spin_unlock(&sensor->lock);
-
-	/* Why use spinlocks? See LDD3, p. 119 */
+	lunix_sensor_snapshot(sensor, type, &snap);
 
 	/*
 	 * Any new data available?
 	 */
 	
 	/* ? --> done */
-	if(state->buf_timestamp == timestamp)
+	if(state->buf_seq == snap.seq)
 		return -EAGAIN;
 	
 	/*
@@ -112,26 +118,25 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 	 * holding only the private state semaphore
 	 */
 
-	/* ? --> done */
-	long lookup_value;	
-
-	switch(type) {
-		case BATT:
-			lookup_value = lookup_voltage[data];
-			break;
-		case TEMP:
-			lookup_value = lookup_temperature[data];
-			break;
-		case LIGHT:
-			lookup_value = lookup_light[data];
-			break;
+	/*
+	 * Binary mode: a fixed-size record, nothing to format. buf_data
+	 * is not aligned for one, so it is built on the stack.
+	 */
+	if (state->flags & LUNIX_FL_BINARY) {
+		struct lunix_record rec;
+
+		lunix_chrdev_fill_record(&rec, state, &snap);
+		memcpy(state->buf_data, &rec, sizeof(rec));
+		state->buf_lim = sizeof(rec);
+		state->buf_seq = snap.seq;
+		return 0;
 	}
 
-	int integer_part = lookup_value / 1000;
-	int decimal_part = lookup_value > 0 ? lookup_value % 1000 : -lookup_value % 1000;
+	/* ? --> done */
+	long lookup_value = lunix_msr_convert(type, snap.value);
 
-	state->buf_lim = snprintf(state->buf_data, LUNIX_CHRDEV_BUFSZ, "%d.%d\n", integer_part, decimal_part); 
-	state->buf_timestamp = timestamp;
+	state->buf_lim = lunix_msr_format((char *)state->buf_data, lookup_value);
+	state->buf_seq = snap.seq;
 
 	debug("leaving\n");
 	return 0;
@@ -164,17 +169,39 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 
 	unsigned int minor = iminor(inode);
 
+	/*
+	 * Only the first N_LUNIX_MSR of every 8 minors are measurements,
+	 * the rest would index past msr_data[] and wq[] of the sensor
+	 */
+	if ((minor & 7) >= N_LUNIX_MSR) {
+		ret = -ENODEV;
+		goto out;
+	}
+
 	/* Allocate a new Lunix character device private state structure */
 	
 	/* ? -> done */
 	struct lunix_chrdev_state_struct* state;
 	state = (struct lunix_chrdev_state_struct*) kmalloc(sizeof(struct lunix_chrdev_state_struct), GFP_KERNEL);
+	if (!state) {
+		ret = -ENOMEM;
+		goto out;
+	}
 	
 	/* Fill all fields of lunix_chrdev_state_struct */
 	state->type = minor & 7; /* ...xxx & ...111, τα 3 LSB */ 
-	state->sensor = &lunix_sensors[minor >> 3]; /* xxx... -> xxx, "ξεχνάμε" τα 3 LSB */ 
+	/* xxx... -> xxx, "ξεχνάμε" τα 3 LSB. Node ids start at 1 */
+	/* The sensor may not have reported yet, readers just wait for it */
+	state->sensor = lunix_sensor_get_or_create((minor >> 3) + 1);
+	if (!state->sensor) {
+		kfree(state);
+		ret = -ENOMEM;
+		goto out;
+	}
 	state->buf_lim = 0; 
-	state->buf_timestamp = 0; 
+	state->buf_seq = 0; 
+	state->flags = 0;
+	state->stream = NULL;
 	sema_init(&state->lock, 1);
 
 	filp->private_data = state;
@@ -186,21 +213,277 @@ out:
 static int lunix_chrdev_release(struct inode *inode, struct file *filp) 
 {
 	/* ? --> done */
-	kfree(filp->private_data);
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
+	if (state->stream) {
+		if (state->flags & LUNIX_FL_STREAM)
+			lunix_stream_detach(state->sensor, state->stream);
+		lunix_stream_destroy(state->stream);
+	}
+	kfree(state);
 	return 0;
 }
 
 /*
- * Στην περίπτωσή μας ουσιαστικά δεν την ορίζουμε.
- */ 
-static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+ * LUNIX_IOC_HISTORY: copies a backlog of samples out of
+ * the history ring of the measurement, see lunix-chrdev.h
+ */
+static long lunix_chrdev_history(struct lunix_chrdev_state_struct *state,
+	struct lunix_history __user *uhist)
 {
-	/* 
-	 * Why? --> Γιατί ουσιαστικά δεν υλοποιούμε την ioctl, οπότε σύμφωνα με τον οδηγό
-	 * πρέπει να επιστρέφουμε -EINVAL.
+	struct lunix_sensor_struct *sensor = state->sensor;
+	struct lunix_msr_data_struct *msr = sensor->msr_data[state->type];
+	struct lunix_history hist;
+	struct lunix_sample *samples;
+	uint64_t want, seq;
+	uint32_t room, back, slot, n, i;
+	unsigned int lock_seq;
+	long ret;
+
+	if (copy_from_user(&hist, uhist, sizeof(hist)))
+		return -EFAULT;
+
+	/* Samples are numbered from 1, there is no sample 0 */
+	want = max_t(uint64_t, hist.start, 1);
+	room = min_t(uint32_t, hist.count, LUNIX_MSR_HIST_LEN);
+	samples = kmalloc_array(max_t(uint32_t, room, 1), sizeof(*samples), GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+
+	/* Copy a consistent run of samples, retrying if the writer got in the way */
+	do {
+		lock_seq = read_seqbegin(&sensor->lock);
+		seq = msr->seq;
+		hist.start = want;
+		/* Nothing newer than what was asked for, or gone already */
+		if (hist.start > seq)
+			hist.start = seq + 1;
+		else if (seq - hist.start >= LUNIX_MSR_HIST_LEN)
+			hist.start = seq - LUNIX_MSR_HIST_LEN + 1;
+		/* At most LUNIX_MSR_HIST_LEN back, 32 bits are enough from here on */
+		back = seq + 1 - hist.start;
+		n = min(room, back);
+
+		slot = (msr->head + LUNIX_MSR_HIST_LEN - back) % LUNIX_MSR_HIST_LEN;
+		for (i = 0; i < n; i++) {
+			samples[i].timestamp = msr->timestamps[slot];
+			samples[i].value = msr->values[slot];
+			if (++slot == LUNIX_MSR_HIST_LEN)
+				slot = 0;
+		}
+	} while (read_seqretry(&sensor->lock, lock_seq));
+
+	/* Convert outside the lock */
+	for (i = 0; i < n; i++)
+		samples[i].value = lunix_msr_convert(state->type, samples[i].value);
+	hist.count = n;
+
+	ret = -EFAULT;
+	if (copy_to_user(u64_to_user_ptr(hist.samples), samples, n * sizeof(*samples)))
+		goto out;
+	if (copy_to_user(uhist, &hist, sizeof(hist)))
+		goto out;
+	ret = 0;
+out:
+	kfree(samples);
+	return ret;
+}
+
+static void lunix_chrdev_agg_window(struct lunix_agg_window *w,
+	const struct lunix_agg_struct *agg, int length)
+{
+	w->start = agg->start;
+	w->length = length;
+	w->count = agg->count;
+	w->min = agg->count ? agg->min : 0;
+	w->max = agg->count ? agg->max : 0;
+	w->mean = agg->count ? div_s64(agg->sum, agg->count) : 0;
+	w->sum = agg->count ? agg->sum : 0;
+}
+
+/*
+ * LUNIX_IOC_AGGREGATES: reports the aggregates of the measurement
+ * over each window, see lunix-chrdev.h. A window in progress
+ * may have ended since the last sample; it is then reported as
+ * the previous one.
+ */
+static long lunix_chrdev_aggregates(struct lunix_chrdev_state_struct *state,
+	struct lunix_aggregates __user *uaggs)
+{
+	struct lunix_agg_struct agg[LUNIX_AGG_NR_WINDOWS], agg_prev[LUNIX_AGG_NR_WINDOWS];
+	struct lunix_aggregates aggs;
+	uint32_t now = get_seconds();
+	int i, len;
+
+	lunix_sensor_aggregates(state->sensor, state->type, agg, agg_prev);
+
+	memset(&aggs, 0, sizeof(aggs));
+	for (i = 0; i < LUNIX_AGG_NR_WINDOWS; i++) {
+		len = lunix_agg_windows[i];
+		if (agg[i].count && agg[i].start + len <= now) {
+			agg_prev[i] = agg[i];
+			agg[i].count = 0;
+		}
+		if (!agg[i].count)
+			agg[i].start = now - now % len;
+		lunix_chrdev_agg_window(&aggs.cur[i], &agg[i], len);
+		lunix_chrdev_agg_window(&aggs.prev[i], &agg_prev[i], len);
+	}
+
+	if (copy_to_user(uaggs, &aggs, sizeof(aggs)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * LUNIX_IOC_SETFLAGS: changes the mode settings of this open file
+ */
+static long lunix_chrdev_setflags(struct file *filp, uint32_t __user *uflags)
+{
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	uint32_t flags;
+
+	if (get_user(flags, uflags))
+		return -EFAULT;
+	if (flags & ~LUNIX_FL_ALL)
+		return -EINVAL;
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+	/*
+	 * Whatever is cached is in the old format; drop it,
+	 * so that the latest measurement is reported anew.
 	 */
+	if ((flags ^ state->flags) & LUNIX_FL_BINARY) {
+		state->buf_lim = 0;
+		state->buf_seq = 0;
+		filp->f_pos = 0;
+	}
 
-	return -EINVAL; 
+	/* The queue is set up once, and kept for next time when leaving */
+	if ((flags & LUNIX_FL_STREAM) && !state->stream) {
+		state->stream = lunix_stream_create(state->type,
+			clamp(READ_ONCE(lunix_stream_len), 2, LUNIX_STREAM_MAX_LEN));
+		if (!state->stream) {
+			up(&state->lock);
+			return -ENOMEM;
+		}
+	}
+	if (state->stream)
+		WRITE_ONCE(state->stream->drop_newest, !!(flags & LUNIX_FL_DROP_NEWEST));
+	if ((flags ^ state->flags) & LUNIX_FL_STREAM) {
+		if (flags & LUNIX_FL_STREAM)
+			lunix_stream_attach(state->sensor, state->stream);
+		else
+			lunix_stream_detach(state->sensor, state->stream);
+	}
+
+	state->flags = flags;
+	up(&state->lock);
+
+	/* Nothing more will be queued, readers asleep on it go back to read() */
+	if (!(flags & LUNIX_FL_STREAM))
+		wake_up_interruptible_all(&state->sensor->wq[state->type]);
+	return 0;
+}
+
+/*
+ * LUNIX_IOC_DROPS: samples dropped from the queue of this open file
+ * since it last entered streaming mode, none outside it
+ */
+static long lunix_chrdev_drops(struct lunix_chrdev_state_struct *state, uint64_t __user *udrops)
+{
+	struct lunix_stream_struct *st = READ_ONCE(state->stream);
+
+	return put_user(st ? lunix_stream_drops(st) : 0, udrops);
+}
+
+static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
+	if (_IOC_TYPE(cmd) != LUNIX_IOC_MAGIC || _IOC_NR(cmd) > LUNIX_IOC_MAXNR)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case LUNIX_IOC_HISTORY:
+		return lunix_chrdev_history(state, (struct lunix_history __user *)arg);
+	case LUNIX_IOC_SETFLAGS:
+		return lunix_chrdev_setflags(filp, (uint32_t __user *)arg);
+	case LUNIX_IOC_GETFLAGS:
+		return put_user(READ_ONCE(state->flags), (uint32_t __user *)arg);
+	case LUNIX_IOC_AGGREGATES:
+		return lunix_chrdev_aggregates(state, (struct lunix_aggregates __user *)arg);
+	case LUNIX_IOC_DROPS:
+		return lunix_chrdev_drops(state, (uint64_t __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Streaming mode: drains the queue of samples of this open file,
+ * as many as fit, waiting for one if it is empty. The state lock
+ * is not needed, the queue is only reset under its own lock.
+ * Returns 0 if streaming mode was left meanwhile, or another reader
+ * emptied the queue first, for read() to start over.
+ */
+/*
+ * Wait condition of streaming readers: something queued,
+ * or no more to come, as the file left streaming mode
+ */
+static int lunix_chrdev_stream_ready(struct lunix_chrdev_state_struct *state)
+{
+	return !kfifo_is_empty(&state->stream->fifo) ||
+		!(READ_ONCE(state->flags) & LUNIX_FL_STREAM);
+}
+
+static ssize_t lunix_chrdev_stream_read(struct file *filp, char __user *usrbuf, size_t cnt)
+{
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	struct lunix_stream_struct *st = state->stream;
+	struct lunix_msr_snapshot snaps[LUNIX_STREAM_BATCH];
+	struct lunix_record recs[LUNIX_STREAM_BATCH];
+	wait_queue_head_t *wq = &state->sensor->wq[state->type];
+	unsigned int n, i;
+	ssize_t ret;
+
+	if (cnt < sizeof(*recs))
+		return -EINVAL;
+
+	while (kfifo_is_empty(&st->fifo)) {
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (state->flags & LUNIX_FL_EXCLUSIVE)
+			ret = wait_event_interruptible_exclusive(*wq, lunix_chrdev_stream_ready(state));
+		else
+			ret = wait_event_interruptible(*wq, lunix_chrdev_stream_ready(state));
+		if (ret)
+			return -ERESTARTSYS;
+		if (!(READ_ONCE(state->flags) & LUNIX_FL_STREAM))
+			return 0;
+	}
+
+	/* A batch at a time, converted and copied outside the queue lock */
+	for (ret = 0; cnt - ret >= sizeof(*recs); ret += n * sizeof(*recs)) {
+		n = lunix_stream_out(st, snaps, min_t(size_t, LUNIX_STREAM_BATCH, (cnt - ret) / sizeof(*recs)));
+		if (!n)
+			break;
+		for (i = 0; i < n; i++)
+			lunix_chrdev_fill_record(&recs[i], state, &snaps[i]);
+		if (copy_to_user(usrbuf + ret, recs, n * sizeof(*recs)))
+			return -EFAULT;
+	}
+	return ret;
+}
+
+/*
+ * In binary mode, a read() that cannot take a whole record fails,
+ * rather than return part of one. Text may be read in pieces.
+ */
+static int lunix_chrdev_read_too_short(struct lunix_chrdev_state_struct *state, size_t cnt)
+{
+	return (state->flags & LUNIX_FL_BINARY) && cnt < sizeof(struct lunix_record);
 }
 
 static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
@@ -216,9 +499,25 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 	sensor = state->sensor;
 	WARN_ON(!sensor);
 
+again:
 	/* Lock? --> done */
 	if (down_interruptible(&state->lock))
 		return -ERESTARTSYS;
+
+	/* Streaming mode: no cached state involved */
+	if (state->flags & LUNIX_FL_STREAM) {
+		up(&state->lock);
+		ret = lunix_chrdev_stream_read(filp, usrbuf, cnt);
+		if (ret == 0)
+			goto again;
+		return ret;
+	}
+
+	/* Binary mode: a whole record per read, or nothing */
+	if (lunix_chrdev_read_too_short(state, cnt)) {
+		ret = -EINVAL;
+		goto out;
+	}
 	
 	/*
 	 * If the cached character device state needs to be
@@ -227,16 +526,38 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 	 */
 	if (*f_pos == 0) {
 		while (lunix_chrdev_state_update(state) == -EAGAIN) {
+			/*
+			 * Nothing fresh, and asked not to wait for it.
+			 * The cached state is untouched, just unlock.
+			 */
+			if (filp->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				goto out;
+			}
+
 			/* ? --> done */
 			/* The process needs to sleep */
 			/* See LDD3, page 153 for a hint */
 			up(&state->lock);
 
-			if (wait_event_interruptible(sensor->wq, lunix_chrdev_state_needs_refresh(state))) 
+			/* Worker pools wait exclusively, to be woken up one at a time */
+			if (state->flags & LUNIX_FL_EXCLUSIVE)
+				ret = wait_event_interruptible_exclusive(sensor->wq[state->type],
+					lunix_chrdev_state_needs_refresh(state));
+			else
+				ret = wait_event_interruptible(sensor->wq[state->type],
+					lunix_chrdev_state_needs_refresh(state));
+			if (ret)
 				return -ERESTARTSYS;
 
 			if (down_interruptible(&state->lock)) 
 				return -ERESTARTSYS;
+
+			/* The mode may have been changed meanwhile */
+			if (lunix_chrdev_read_too_short(state, cnt)) {
+				ret = -EINVAL;
+				goto out;
+			}
 		}
 	}
 
@@ -249,7 +570,7 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 
 	cnt = min(cnt, bytes_left);
 
-	if (copy_to_user(usrbuf, state->buf_data, cnt)) {
+	if (copy_to_user(usrbuf, state->buf_data + *f_pos, cnt)) {
 		ret = -EFAULT;
 		goto out;
 	}
@@ -269,15 +590,53 @@ out:
 }
 
 /*
- * Στην περίπτωσή μας ουσιαστικά δεν την ορίζουμε.
+ * Readable whenever read() would not sleep: there is a fresh
+ * measurement, or part of the last one is still to be read,
+ * or anything queued in streaming mode
+ */
+static __poll_t lunix_chrdev_poll(struct file *filp, poll_table *wait)
+{
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	struct lunix_stream_struct *st;
+
+	poll_wait(filp, &state->sensor->wq[state->type], wait);
+	/* Pairs with wq_has_sleeper() in lunix_sensor_wake() */
+	smp_mb();
+
+	st = READ_ONCE(state->stream);
+	if ((READ_ONCE(state->flags) & LUNIX_FL_STREAM) && st)
+		return kfifo_is_empty(&st->fifo) ? 0 : EPOLLIN | EPOLLRDNORM;
+
+	if (READ_ONCE(filp->f_pos) != 0 || lunix_chrdev_state_needs_refresh(state))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+/*
+ * Maps the measurement buffer of the opened node read-only, all of it
+ * or any part, so that its samples can be read with no syscalls at all.
+ * The layout is struct lunix_msr_data_struct; see lunix.h for how
+ * to read it consistently, without the sensor seqlock.
+ *
+ * The pages are freed only when the module is unloaded, which the
+ * mapping prevents by keeping the file open.
  */
 static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	/* 
-	 * Πάλι ουσιαστικά δεν υλοποιούμε την mmap,
-	 * οπότε επιστρέφουμε -EINVAL.
-	 */
-	return -EINVAL;
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	struct lunix_msr_data_struct *msr = state->sensor->msr_data[state->type];
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long pages = 1UL << LUNIX_MSR_ORDER;
+
+	if (vma->vm_pgoff >= pages || size > (pages - vma->vm_pgoff) << PAGE_SHIFT)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+	return remap_pfn_range(vma, vma->vm_start,
+		(virt_to_phys(msr) >> PAGE_SHIFT) + vma->vm_pgoff, size, vma->vm_page_prot);
 }
 
 static struct file_operations lunix_chrdev_fops = 
@@ -286,6 +645,7 @@ static struct file_operations lunix_chrdev_fops =
 	.open           = lunix_chrdev_open,
 	.release        = lunix_chrdev_release,
 	.read           = lunix_chrdev_read,
+	.poll           = lunix_chrdev_poll,
 	.unlocked_ioctl = lunix_chrdev_ioctl,
 	.mmap           = lunix_chrdev_mmap
 };
@@ -302,7 +662,10 @@ int lunix_chrdev_init(void)
 	dev_t dev_no;
 
 	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3; 
-	
+
+	BUILD_BUG_ON(sizeof(struct lunix_record) > LUNIX_CHRDEV_BUFSZ);
+	BUILD_BUG_ON(LUNIX_MSR_TEXT_MAX > LUNIX_CHRDEV_BUFSZ);
+
 	debug("initializing character device\n");
 
 	cdev_init(&lunix_chrdev_cdev, &lunix_chrdev_fops);
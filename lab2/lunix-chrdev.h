@@ -14,7 +14,9 @@
  * Lunix:TNG character device
  */
 #define LUNIX_CHRDEV_MAJOR	60	/* Reserved for local / experimental use */
-#define LUNIX_CHRDEV_BUFSZ      20      /* Buffer size used to hold textual info */
+#define LUNIX_CHRDEV_BUFSZ      32      /* Buffer size used to hold textual info, or a struct lunix_record */
+#define LUNIX_STREAM_BATCH      8       /* Samples taken off a stream at a time by read() */
+#define LUNIX_STREAM_MAX_LEN    65536   /* Upper bound on lunix_stream_len */
 
 /* Compile-time parameters */
 
@@ -36,13 +38,19 @@ struct lunix_chrdev_state_struct {
 	/* A buffer used to hold cached textual info */
 	int buf_lim;
 	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
-	uint32_t buf_timestamp;
+	uint64_t buf_seq;		/* Sequence number of the sample in buf_data */
 
 	struct semaphore lock;
 
+	/* Mode settings, LUNIX_FL_*, see LUNIX_IOC_SETFLAGS */
+	uint32_t flags;
+
 	/*
-	 * Fixme: Any mode settings? e.g. blocking vs. non-blocking
+	 * Queue of samples for streaming mode, allocated the first time
+	 * it is entered and only attached to the sensor while in it.
+	 * Kept until release, so that it can be looked at unlocked.
 	 */
+	struct lunix_stream_struct *stream;
 };
 
 /*
@@ -54,14 +62,112 @@ void lunix_chrdev_destroy(void);
 #endif	/* __KERNEL__ */
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * A sample from the history of a measurement. The value is in
+ * thousandths of the unit of the measurement, as reported by read().
+ */
+struct lunix_sample {
+	__u32 timestamp;
+	__s32 value;
+};
+
+/*
+ * Sequence numbers of samples, wherever they appear [the seq of struct
+ * lunix_record, the start of struct lunix_history, the seq of a mapped
+ * buffer] count the samples of a measurement from 1: the first sample
+ * ever received is 1, and the seq of a mapped buffer is the number of
+ * the most recent one, 0 before any.
+ */
+
+/*
+ * Argument of LUNIX_IOC_HISTORY. On entry, start is the sequence number
+ * of the first sample wanted and count the room in samples[]. On return,
+ * start is the sequence number of the first sample returned, which is
+ * later than asked for if older samples have been overwritten meanwhile,
+ * and count the number of samples returned. Passing start + count
+ * on the next call fetches whatever has arrived since, and so does
+ * passing the seq of the last record read, plus one.
+ */
+struct lunix_history {
+	__u64 start;
+	__u32 count;
+	__u32 reserved;
+	__u64 samples;                  /* struct lunix_sample __user * */
+};
+
+/*
+ * Aggregates of a measurement over a window of time, in thousandths
+ * of its unit, as reported by LUNIX_IOC_AGGREGATES. Windows are aligned
+ * to multiples of their length, in seconds since the epoch.
+ */
+struct lunix_agg_window {
+	__u32 start;                    /* Start of the window, as last_update */
+	__u32 length;                   /* In seconds */
+	__u32 count;                    /* Number of samples, the rest are zero if none */
+	__s32 min;
+	__s32 max;
+	__s32 mean;
+	__s64 sum;
+};
+
+/*
+ * Argument of LUNIX_IOC_AGGREGATES, for each of the LUNIX_AGG_NR_WINDOWS
+ * windows the module keeps aggregates over [see lunix_agg_windows]
+ */
+struct lunix_aggregates {
+	struct lunix_agg_window cur[LUNIX_AGG_NR_WINDOWS];      /* Window in progress */
+	struct lunix_agg_window prev[LUNIX_AGG_NR_WINDOWS];     /* Last window over, with any samples */
+};
+
+/*
+ * A measurement, as returned by read() in binary mode [LUNIX_FL_BINARY],
+ * instead of text. Each read() returns exactly one, and fails with EINVAL
+ * if there is no room for it.
+ */
+struct lunix_record {
+	__u64 seq;                      /* Sequence number of the sample */
+	__u64 timestamp_ns;             /* CLOCK_MONOTONIC time it was received, in ns */
+	__u32 timestamp;                /* Time it was received, in seconds, as last_update */
+	__s32 value;                    /* In thousandths of the unit of the measurement */
+	__u16 raw;                      /* Raw 16-bit value, as sent by the sensor */
+	__u16 nodeid;
+	__u32 type;                     /* 0 for battery, 1 for temperature, 2 for light */
+};
+
+/*
+ * Per-open mode flags, for LUNIX_IOC_SETFLAGS and LUNIX_IOC_GETFLAGS
+ *
+ * In streaming mode, every sample received from the moment it is
+ * entered is queued for the open file, up to lunix_stream_len of them,
+ * instead of only the latest being kept. read() returns as many whole
+ * struct lunix_record as fit, oldest first, and fails with EINVAL if
+ * not even one does. When the queue is full, either the oldest sample
+ * in it or the newest one is dropped; LUNIX_IOC_DROPS tells how many.
+ * Leaving streaming mode throws away whatever was left queued, and
+ * the count of drops with it, and wakes up readers waiting on the queue,
+ * which go on in the mode the file is in now.
+ */
+#define LUNIX_FL_EXCLUSIVE		0x0001	/* Wait exclusively, only one such reader wakes per update */
+#define LUNIX_FL_BINARY			0x0002	/* Read struct lunix_record instead of text */
+#define LUNIX_FL_STREAM			0x0004	/* Read every sample, as struct lunix_record */
+#define LUNIX_FL_DROP_NEWEST		0x0008	/* Streaming: drop the newest sample when full, not the oldest */
+
+#define LUNIX_FL_ALL			(LUNIX_FL_EXCLUSIVE | LUNIX_FL_BINARY | \
+					 LUNIX_FL_STREAM | LUNIX_FL_DROP_NEWEST)
 
 /*
  * Definition of ioctl commands
  */
 #define LUNIX_IOC_MAGIC			LUNIX_CHRDEV_MAJOR
-//#define LUNIX_IOC_EXAMPLE		_IOR(LUNIX_IOC_MAGIC, 0, void *)
+#define LUNIX_IOC_HISTORY		_IOWR(LUNIX_IOC_MAGIC, 1, struct lunix_history)
+#define LUNIX_IOC_SETFLAGS		_IOW(LUNIX_IOC_MAGIC, 2, __u32)
+#define LUNIX_IOC_GETFLAGS		_IOR(LUNIX_IOC_MAGIC, 3, __u32)
+#define LUNIX_IOC_AGGREGATES		_IOR(LUNIX_IOC_MAGIC, 4, struct lunix_aggregates)
+#define LUNIX_IOC_DROPS			_IOR(LUNIX_IOC_MAGIC, 5, __u64)	/* Samples dropped since streaming began */
 
-#define LUNIX_IOC_MAXNR			0	
+#define LUNIX_IOC_MAXNR			5	
 
 #endif	/* _LUNIX_H */
 
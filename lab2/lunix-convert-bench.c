@@ -0,0 +1,163 @@
+/*
+ * lunix-convert-bench.c
+ *
+ * Compares the conversion of raw measurements to thousandths
+ * of their unit by lunix_msr_convert(), on the compact tables of
+ * lunix-lookup.h, against the original 65536-entry tables of longs,
+ * as generated by mk_lookup_tables -l, in speed and memory footprint.
+ *
+ * It is built from the same lunix-sensors.c as the kernel module,
+ * on top of the shims in uspace/.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "lunix.h"
+#include "lunix-stats.h"
+#include "lunix-lookup.h"
+#include "lunix-lookup-legacy.h"
+
+/*
+ * Global state, as defined by lunix-module.c and lunix-stats.c in the kernel
+ */
+int lunix_sensor_cnt = 1;
+int lunix_wake_on_change = 0;
+int lunix_agg_windows[LUNIX_AGG_NR_WINDOWS] = { 1, 10, 60 };
+DEFINE_XARRAY(lunix_sensors);
+struct lunix_fleet_entry *lunix_fleet_entries;
+atomic64_t lunix_sensors_gen;
+DEFINE_PER_CPU(struct lunix_stats_struct, lunix_stats);
+
+struct sample {
+	enum lunix_msr_enum type;
+	uint32_t data;
+};
+
+/*
+ * lunix_msr_convert() as it was, not inlined, as it is not
+ * across translation units in the module either
+ */
+static __attribute__((noinline)) long legacy_convert(enum lunix_msr_enum type, uint32_t data)
+{
+	switch (type) {
+	case BATT:
+		return lookup_legacy_voltage[data];
+	case TEMP:
+		return lookup_legacy_temperature[data];
+	case LIGHT:
+		return lookup_legacy_light[data];
+	default:
+		return 0;
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Both must agree on every raw value the sensors can send
+ */
+static unsigned long check(void)
+{
+	unsigned long bad = 0;
+	uint32_t data;
+
+	for (data = 0; data < LOOKUP_ADC_SZ; data++) {
+		bad += lunix_msr_convert(BATT, data) != legacy_convert(BATT, data);
+		bad += lunix_msr_convert(TEMP, data) != legacy_convert(TEMP, data);
+	}
+	for (data = 0; data <= 0xFFFF; data++)
+		bad += lunix_msr_convert(LIGHT, data) != legacy_convert(LIGHT, data);
+	return bad;
+}
+
+static void run(const char *name, struct sample *samples, int n, int rounds)
+{
+	long sum_legacy = 0, sum = 0;
+	double t, t_legacy;
+	int r, i;
+
+	t = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n; i++)
+			sum_legacy += legacy_convert(samples[i].type, samples[i].data);
+	t_legacy = now() - t;
+
+	t = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n; i++)
+			sum += lunix_msr_convert(samples[i].type, samples[i].data);
+	t = now() - t;
+
+	printf("%-18s %10.3f %10.3f %9.2fx%s\n", name,
+		t_legacy * 1e9 / ((double)n * rounds), t * 1e9 / ((double)n * rounds),
+		t_legacy / t, sum == sum_legacy ? "" : "   (values differ)");
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-n samples] [-r rounds]\n\n"
+		"Time conversions of random raw values of random measurements.\n"
+		"  -n samples  number of distinct samples [1000000]\n"
+		"  -r rounds   number of times to convert them [20]\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sample *adc, *wide;
+	int n = 1000000, rounds = 20, opt, i;
+	size_t legacy_sz, sz;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case 'n': n = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || n <= 0 || rounds <= 0)
+		usage(argv[0]);
+
+	adc = malloc(n * sizeof(*adc));
+	wide = malloc(n * sizeof(*wide));
+	if (!adc || !wide) {
+		perror("malloc");
+		return 1;
+	}
+
+	/*
+	 * Values as sent by the 10-bit ADC, and over the full 16-bit range,
+	 * which the original tables cover, for light and for garbage
+	 */
+	srand(1);
+	for (i = 0; i < n; i++) {
+		adc[i].type = wide[i].type = rand() % N_LUNIX_MSR;
+		adc[i].data = rand() % LOOKUP_ADC_SZ;
+		wide[i].data = rand() % 0x10000;
+	}
+
+	legacy_sz = sizeof(lookup_legacy_temperature) + sizeof(lookup_legacy_voltage) +
+		sizeof(lookup_legacy_light);
+	sz = sizeof(lookup_temperature) + sizeof(lookup_voltage);
+
+	printf("table bytes:       %10zu %10zu %9.2fx\n", legacy_sz, sz, (double)legacy_sz / sz);
+	printf("mismatches:        %lu\n\n", check());
+	printf("%-18s %10s %10s %10s\n", "ns/conversion", "legacy", "compact", "speedup");
+	run("10-bit raw values", adc, n, rounds);
+	run("16-bit raw values", wide, n, rounds);
+
+	return 0;
+}
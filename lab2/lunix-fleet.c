@@ -0,0 +1,168 @@
+/*
+ * lunix-fleet.c
+ *
+ * The fleet region of Lunix:TNG, holding the latest measurements
+ * of all sensors packed together, and /dev/lunix-fleet for mapping
+ * it to userspace, along with /dev/lunix-all, for reading the latest
+ * measurements of all sensors in one go. See lunix.h for their layout.
+ *
+ */
+
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/miscdevice.h>
+
+#include "lunix.h"
+
+struct lunix_fleet_entry *lunix_fleet_entries;
+
+static int lunix_fleet_open(struct inode *inode, struct file *filp)
+{
+	return nonseekable_open(inode, filp);
+}
+
+/*
+ * Maps the region read-only, all of it or any part
+ */
+static int lunix_fleet_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, lunix_fleet_entries, vma->vm_pgoff);
+}
+
+static const struct file_operations lunix_fleet_fops = {
+	.owner          = THIS_MODULE,
+	.open           = lunix_fleet_open,
+	.mmap           = lunix_fleet_mmap
+};
+
+static struct miscdevice lunix_fleet_dev = {
+	.minor          = MISC_DYNAMIC_MINOR,
+	.name           = "lunix-fleet",
+	.fops           = &lunix_fleet_fops,
+	.mode           = 0444
+};
+
+/*
+ * Returns the sensors updated after generation *f_pos, all in one go,
+ * and moves on to the latest generation. See lunix.h.
+ */
+static ssize_t lunix_all_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
+{
+	struct lunix_all_header hdr = { .magic = LUNIX_ALL_MAGIC };
+	struct lunix_all_entry e;
+	struct lunix_sensor_struct *s;
+	unsigned long nodeid;
+	size_t len = sizeof(hdr);
+
+	if (cnt < sizeof(hdr))
+		return -EINVAL;
+
+	/*
+	 * Any update up to here has already taken the sensor seqlock,
+	 * so lunix_sensor_all_entry() sees it through. Later ones may
+	 * or may not be seen, and are returned again next time.
+	 */
+	hdr.gen = atomic64_read(&lunix_sensors_gen);
+	smp_rmb();
+
+	/* Sensors are never freed while the module is loaded */
+	xa_for_each(&lunix_sensors, nodeid, s) {
+		if (!lunix_sensor_all_entry(s, *f_pos, &e))
+			continue;
+		if (len + sizeof(e) > cnt) {
+			hdr.flags |= LUNIX_ALL_TRUNCATED;
+			break;
+		}
+		if (copy_to_user(usrbuf + len, &e, sizeof(e)))
+			return -EFAULT;
+		len += sizeof(e);
+		hdr.nr_entries++;
+	}
+
+	if (copy_to_user(usrbuf, &hdr, sizeof(hdr)))
+		return -EFAULT;
+	if (!(hdr.flags & LUNIX_ALL_TRUNCATED))
+		*f_pos = hdr.gen;
+
+	return len;
+}
+
+static const struct file_operations lunix_all_fops = {
+	.owner          = THIS_MODULE,
+	.read           = lunix_all_read,
+	.llseek         = default_llseek
+};
+
+static struct miscdevice lunix_all_dev = {
+	.minor          = MISC_DYNAMIC_MINOR,
+	.name           = "lunix-all",
+	.fops           = &lunix_all_fops,
+	.mode           = 0444
+};
+
+/*
+ * Always registers /dev/lunix-all, while the fleet region
+ * is only set up if the module was loaded with lunix_fleet=1
+ */
+int lunix_fleet_init(void)
+{
+	struct lunix_fleet_header *hdr;
+	int ret;
+
+	BUILD_BUG_ON(sizeof(struct lunix_fleet_entry) != LUNIX_FLEET_ENTRY_SZ);
+	BUILD_BUG_ON(sizeof(struct lunix_fleet_header) > LUNIX_FLEET_ENTRY_SZ);
+
+	ret = misc_register(&lunix_all_dev);
+	if (ret < 0) {
+		printk(KERN_ERR "Failed to register /dev/lunix-all, ret = %d\n", ret);
+		return ret;
+	}
+
+	if (!lunix_fleet)
+		return 0;
+
+	/* Zeroed, and page aligned so that it can be mapped */
+	lunix_fleet_entries = vmalloc_user((lunix_sensor_cnt + 1) * sizeof(*lunix_fleet_entries));
+	if (!lunix_fleet_entries) {
+		printk(KERN_ERR "Failed to allocate the Lunix fleet region\n");
+		ret = -ENOMEM;
+		goto out_with_all;
+	}
+	hdr = (struct lunix_fleet_header *)lunix_fleet_entries;
+	hdr->magic = LUNIX_FLEET_MAGIC;
+	hdr->nr_entries = lunix_sensor_cnt + 1;
+
+	ret = misc_register(&lunix_fleet_dev);
+	if (ret < 0) {
+		printk(KERN_ERR "Failed to register /dev/lunix-fleet, ret = %d\n", ret);
+		goto out_with_entries;
+	}
+
+	debug("fleet region of %d entries at %p\n", lunix_sensor_cnt + 1, lunix_fleet_entries);
+	return 0;
+
+out_with_entries:
+	vfree(lunix_fleet_entries);
+	lunix_fleet_entries = NULL;
+out_with_all:
+	misc_deregister(&lunix_all_dev);
+	return ret;
+}
+
+void lunix_fleet_destroy(void)
+{
+	if (lunix_fleet_entries) {
+		misc_deregister(&lunix_fleet_dev);
+		vfree(lunix_fleet_entries);
+		lunix_fleet_entries = NULL;
+	}
+	misc_deregister(&lunix_all_dev);
+}
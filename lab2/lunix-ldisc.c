@@ -7,40 +7,156 @@
  *
  */
 
+#include <linux/mm.h>
 #include <linux/tty.h>
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/serio.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/bitmap.h>
+#include <linux/workqueue.h>
 
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
 #include "lunix.h"
 #include "lunix-ldisc.h"
+#include "lunix-stats.h"
+#include "lunix-trace.h"
 #include "lunix-protocol.h"
 
 /*
- * This line discipline can only be associated
- * with a single TTY at any time.
+ * Deferred mode flow control. The throttling decisions of
+ * lunix_ldisc_receive() and lunix_ldisc_work() are serialized
+ * by throttle_lock, both run in process context.
  */
-static atomic_t lunix_disc_available;
+static void lunix_ldisc_check_throttle(struct lunix_ldisc_struct *ldisc)
+{
+	mutex_lock(&ldisc->throttle_lock);
+	if (!ldisc->throttled && ldisc->head - READ_ONCE(ldisc->tail) >= ldisc->hiwat) {
+		ldisc->throttled = 1;
+		tty_throttle(ldisc->tty);
+	}
+	mutex_unlock(&ldisc->throttle_lock);
+}
+
+static void lunix_ldisc_check_unthrottle(struct lunix_ldisc_struct *ldisc)
+{
+	mutex_lock(&ldisc->throttle_lock);
+	if (ldisc->throttled && READ_ONCE(ldisc->head) - ldisc->tail <= ldisc->lowat) {
+		ldisc->throttled = 0;
+		tty_unthrottle(ldisc->tty);
+	}
+	mutex_unlock(&ldisc->throttle_lock);
+}
+
+/*
+ * Deferred mode: drains the ring of received bytes in batches.
+ * Sensor wakeups are collected while parsing and only
+ * issued once the ring is empty.
+ */
+static void lunix_ldisc_work(struct work_struct *work)
+{
+	struct lunix_ldisc_struct *ldisc = container_of(work, struct lunix_ldisc_struct, work);
+	unsigned int head, tail, off, cnt;
+
+	tail = ldisc->tail;
+	while ((head = smp_load_acquire(&ldisc->head)) != tail) {
+		off = tail & (LUNIX_LDISC_RING_SZ - 1);
+		cnt = min(head - tail, LUNIX_LDISC_RING_SZ - off);
+		lunix_protocol_received_buf(&ldisc->proto, &ldisc->ring[off], cnt);
+		tail += cnt;
+		/* Hand the space back to lunix_ldisc_receive() */
+		smp_store_release(&ldisc->tail, tail);
+
+		if (READ_ONCE(ldisc->throttled))
+			lunix_ldisc_check_unthrottle(ldisc);
+	}
+
+	lunix_protocol_flush_wakeups(&ldisc->proto);
+
+	if (READ_ONCE(ldisc->throttled))
+		lunix_ldisc_check_unthrottle(ldisc);
+
+	/* Ask the TTY layer for any data we had to leave behind */
+	if (xchg(&ldisc->stalled, 0) && ldisc->tty->port)
+		tty_flip_buffer_push(ldisc->tty->port);
+}
+
+/*
+ * Deferred mode: queues received bytes for lunix_ldisc_work().
+ * Returns the number of bytes queued, which may be less than count
+ * if the ring is full.
+ */
+static int lunix_ldisc_enqueue(struct lunix_ldisc_struct *ldisc,
+	const unsigned char *cp, int count)
+{
+	unsigned int head, tail, off, cnt;
+
+	head = ldisc->head;
+	tail = smp_load_acquire(&ldisc->tail);
+
+	cnt = min_t(unsigned int, count, LUNIX_LDISC_RING_SZ - (head - tail));
+	if (cnt < (unsigned int)count)
+		ldisc->stalled = 1;
+
+	off = head & (LUNIX_LDISC_RING_SZ - 1);
+	if (cnt > LUNIX_LDISC_RING_SZ - off) {
+		memcpy(&ldisc->ring[off], cp, LUNIX_LDISC_RING_SZ - off);
+		memcpy(ldisc->ring, cp + LUNIX_LDISC_RING_SZ - off, cnt - (LUNIX_LDISC_RING_SZ - off));
+	} else
+		memcpy(&ldisc->ring[off], cp, cnt);
+
+	/* Publish the new bytes to lunix_ldisc_work() */
+	smp_store_release(&ldisc->head, head + cnt);
+
+	if (head + cnt - tail >= ldisc->hiwat)
+		lunix_ldisc_check_throttle(ldisc);
+
+	/*
+	 * Always queue the work after setting stalled or throttling,
+	 * so it gets noticed.
+	 */
+	queue_work(system_unbound_wq, &ldisc->work);
+	return cnt;
+}
 
 /*
  * This function runs when the userspace helper
  * sets the Lunix:TNG line discipline on a TTY.
+ *
+ * The discipline may be set on any number of TTYs at once.
+ * Each one gets its own protocol state machine, kept in
+ * tty->disc_data, and they all feed the same sensors.
  */
 static int lunix_ldisc_open(struct tty_struct *tty)
 {
+	struct lunix_ldisc_struct *ldisc;
+
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
-	
-	/* Can only be associated with a single TTY */
-	if ( !atomic_add_unless(&lunix_disc_available, -1, 0))
-		return -EBUSY;
 
-	tty->receive_room = 65536; /* No flow control, FIXME */
+	ldisc = kvzalloc(sizeof(*ldisc), GFP_KERNEL);
+	if (!ldisc)
+		return -ENOMEM;
+	ldisc->tty = tty;
+	lunix_protocol_init(&ldisc->proto);
+
+	ldisc->deferred = lunix_ldisc_deferred;
+	if (ldisc->deferred) {
+		INIT_WORK(&ldisc->work, lunix_ldisc_work);
+		mutex_init(&ldisc->throttle_lock);
+		ldisc->hiwat = clamp(lunix_ldisc_hiwat, 1, LUNIX_LDISC_RING_SZ);
+		ldisc->lowat = clamp(lunix_ldisc_lowat, 0, (int)ldisc->hiwat - 1);
+		ldisc->proto.wake_pending = bitmap_zalloc(lunix_sensor_cnt, GFP_KERNEL);
+		if (!ldisc->proto.wake_pending) {
+			kvfree(ldisc);
+			return -ENOMEM;
+		}
+	}
+	ldisc->debugfs = lunix_stats_tty_create(tty->name, &ldisc->proto);
+	tty->disc_data = ldisc;
 
 	debug("lunix ldisc associated with TTY %s\n", tty->name);
 	return 0;
@@ -53,7 +169,23 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
-	atomic_inc(&lunix_disc_available);
+	struct lunix_ldisc_struct *ldisc = tty->disc_data;
+
+	if (ldisc->deferred) {
+		cancel_work_sync(&ldisc->work);
+		if (ldisc->throttled)
+			tty_unthrottle(tty);
+		lunix_protocol_flush_wakeups(&ldisc->proto);
+		bitmap_free(ldisc->proto.wake_pending);
+	}
+	lunix_stats_tty_remove(ldisc->debugfs);
+	if (ldisc->proto.crc_errors || ldisc->proto.framing_errors || ldisc->proto.ignored_packets)
+		printk(KERN_INFO "lunix ldisc: %lu packets with bad CRC dropped, "
+			"%lu framing errors, %lu packets of unknown type ignored on TTY %s\n",
+			ldisc->proto.crc_errors, ldisc->proto.framing_errors,
+			ldisc->proto.ignored_packets, tty->name);
+	tty->disc_data = NULL;
+	kvfree(ldisc);
 	/* FIXME */
 	/* Shouldn't we wake up all sleepers in all sensors here? */
 	debug("lunix ldisc being closed\n");
@@ -63,11 +195,14 @@ static void lunix_ldisc_close(struct tty_struct *tty)
  * lunix_ldisc_receive() is called by the TTY layer when data have been
  * received by the low level TTY driver and are ready for us. This function
  * will not be re-entered while running.
+ *
+ * It returns the number of bytes it accepted. Any bytes left over
+ * stay with the TTY layer, which is how it exerts backpressure.
  */
-static void lunix_ldisc_receive(struct tty_struct *tty,
+static int lunix_ldisc_receive(struct tty_struct *tty,
 	const unsigned char *cp, char *fp, int count)
 {
-#if 1
+	struct lunix_ldisc_struct *ldisc = tty->disc_data;
 #if LUNIX_DEBUG
 	int i;
 
@@ -76,14 +211,26 @@ static void lunix_ldisc_receive(struct tty_struct *tty,
 		printk("0x%02x%s", cp[i], (i == count - 1) ? "" : ", ");
 	printk(" }\n");
 #endif
-	printk(KERN_INFO "lunix_ldisc_receive called\n");
-#endif
+	/*
+	 * In deferred mode, only queue them for lunix_ldisc_work().
+	 */
+	if (ldisc->deferred) {
+		count = lunix_ldisc_enqueue(ldisc, cp, count);
+		lunix_stat_add(LUNIX_STAT_BYTES, count);
+		trace_lunix_receive(tty->name, count);
+		return count;
+	}
+
+	lunix_stat_add(LUNIX_STAT_BYTES, count);
+	trace_lunix_receive(tty->name, count);
+
 	/*
 	 * Pass incoming characters to protocol processing code,
 	 * which handle any necessary sensor updates.
 	 */
-	lunix_protocol_received_buf(&lunix_protocol_state, cp, count);
+	lunix_protocol_received_buf(&ldisc->proto, cp, count);
 	//debug("passed incoming bytes to state machine, leaving\n");
+	return count;
 }
 
 /*
@@ -117,7 +264,7 @@ static struct tty_ldisc_ops lunix_ldisc_ops = {
 	.close =	lunix_ldisc_close,
 	.read =		lunix_ldisc_read,
 	.write =	lunix_ldisc_write,
-	.receive_buf =	lunix_ldisc_receive
+	.receive_buf2 =	lunix_ldisc_receive
 };
 
 int lunix_ldisc_init(void)
@@ -125,7 +272,6 @@ int lunix_ldisc_init(void)
 	int ret;
 
 	debug("initializing lunix ldisc\n");
-	atomic_set(&lunix_disc_available, 1);
 	ret = tty_register_ldisc(N_LUNIX_LDISC, &lunix_ldisc_ops);
 	if (ret)
 		printk(KERN_ERR "%s: Error registering line discipline, ret = %d.\n", __FILE__, ret);
@@ -12,9 +12,53 @@
 #define _LUNIX_LDISC_H
 
 /* Compile-time parameters */
+#define LUNIX_LDISC_RING_SZ	65536	/* Must be a power of two */
 
 #ifdef __KERNEL__ 
 
+#include <linux/tty.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
+#include "lunix-protocol.h"
+
+/*
+ * Per-TTY state of the line discipline, kept in tty->disc_data
+ */
+struct lunix_ldisc_struct {
+	struct tty_struct *tty;
+	struct lunix_protocol_state_struct proto;
+	struct dentry *debugfs;         /* lunix/<tty>, the error counters of proto */
+
+	/*
+	 * In deferred mode, received bytes are queued in a
+	 * single-producer, single-consumer ring and parsed in
+	 * batches by a work item. lunix_ldisc_receive() is the only
+	 * producer and only advances head, the work item is the only
+	 * consumer and only advances tail. Both count bytes and wrap
+	 * around freely.
+	 */
+	int deferred;
+	struct work_struct work;
+	unsigned int head;
+	unsigned int tail;
+
+	/*
+	 * Flow control: the TTY is throttled once the ring holds hiwat
+	 * bytes and unthrottled once it has been drained down to lowat.
+	 * stalled is set when the ring could not take all of the data
+	 * the TTY layer offered; the rest stays in the TTY flip buffers
+	 * until the work item makes room and asks for it again.
+	 */
+	unsigned int hiwat;
+	unsigned int lowat;
+	struct mutex throttle_lock;     /* Protects throttled */
+	int throttled;
+	int stalled;
+
+	unsigned char ring[LUNIX_LDISC_RING_SZ];
+};
+
 /*
  * Function prototypes
  */
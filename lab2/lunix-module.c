@@ -14,14 +14,26 @@
 #include "lunix.h"
 #include "lunix-chrdev.h"
 #include "lunix-ldisc.h"
+#include "lunix-stats.h"
 #include "lunix-protocol.h"
 
+#define CREATE_TRACE_POINTS
+#include "lunix-trace.h"
+
 /*
  * Global state for Lunix:TNG sensors
  */
 int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
-struct lunix_sensor_struct *lunix_sensors;
-struct lunix_protocol_state_struct lunix_protocol_state;
+int lunix_crc_check = 1;
+int lunix_ldisc_deferred = 0;
+int lunix_ldisc_hiwat = LUNIX_LDISC_RING_SZ / 4 * 3;
+int lunix_ldisc_lowat = LUNIX_LDISC_RING_SZ / 4;
+DEFINE_XARRAY(lunix_sensors);
+int lunix_fleet = 0;
+int lunix_wake_on_change = 0;
+int lunix_agg_windows[LUNIX_AGG_NR_WINDOWS] = { 1, 10, 60 };
+atomic64_t lunix_sensors_gen = ATOMIC64_INIT(0);
+int lunix_stream_len = 1024;
 
 /*
  * Module init and cleanup functions
@@ -30,37 +42,42 @@ struct lunix_protocol_state_struct lunix_protocol_state;
 int __init lunix_module_init(void)
 {
 	int ret;
-	int si_done;
+	int i;
 
 	printk(KERN_INFO "Initializing the Lunix:TNG module [max %d sensors]\n",
 		lunix_sensor_cnt);
 
-	ret = -ENOMEM;
-	lunix_sensors = kzalloc(sizeof(*lunix_sensors) * lunix_sensor_cnt, GFP_KERNEL);
-	if (!lunix_sensors) {
-		printk(KERN_ERR "Failed to allocate memory for Lunix sensors\n");
-		goto out;
+	/* Node ids are 16-bit, 0 is not a valid one */
+	if (lunix_sensor_cnt <= 0 || lunix_sensor_cnt > 0xFFFF) {
+		printk(KERN_ERR "lunix_sensor_cnt must be between 1 and 65535\n");
+		return -EINVAL;
 	}
-	lunix_protocol_init(&lunix_protocol_state);
+	for (i = 0; i < LUNIX_AGG_NR_WINDOWS; i++)
+		if (lunix_agg_windows[i] <= 0) {
+			printk(KERN_ERR "lunix_agg_windows must all be at least 1 second\n");
+			return -EINVAL;
+		}
+
+	lunix_protocol_crc_init();
+	lunix_stats_init();
 
 	/*
-	 * Initialize all sensors. On exit, si_done is the index of the last
-	 * successfully initialized sensor.
+	 * Sensors are not allocated here, but as soon
+	 * as they report in, or are opened by a reader.
 	 */
-	for (si_done = -1; si_done < lunix_sensor_cnt - 1; si_done++) {
-		debug("initializing sensor %d\n", si_done + 1);
-		ret = lunix_sensor_init(&lunix_sensors[si_done + 1]);
-		debug("initialized sensor %d, ret = %d\n", si_done + 1, ret);
-		if (ret < 0) {
-			goto out_with_sensors;
-		}
-	}
+
+	/*
+	 * Register /dev/lunix-all and set up the fleet region,
+	 * if asked to, before any sensor can be updated
+	 */
+	if ((ret = lunix_fleet_init()) < 0)
+		goto out_with_stats;
 
 	/*
 	 * Initialize the Lunix line discipline
 	 */
 	if ((ret = lunix_ldisc_init()) < 0)
-		goto out_with_sensors;
+		goto out_with_fleet;
 
 	/*
 	 * Initialize the Lunix character device
@@ -77,30 +94,28 @@ int __init lunix_module_init(void)
 out_with_ldisc:
 	debug("at out_with_ldisc\n");
 	lunix_ldisc_destroy();
+	lunix_sensors_destroy();
 
-out_with_sensors:
-	debug("at out_with_sensors\n");
-	for (; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+out_with_fleet:
+	debug("at out_with_fleet\n");
+	lunix_fleet_destroy();
 
-out:
-	debug("at out\n");
+out_with_stats:
+	debug("at out_with_stats\n");
+	lunix_stats_destroy();
 	return ret;
 }
 
 void __exit lunix_module_cleanup(void)
 {
-	int si_done;
-	
 	debug("entering, destroying chrdev and ldisc\n");
 	lunix_chrdev_destroy();
 	lunix_ldisc_destroy();
 	
 	debug("destroying sensor buffers\n");
-	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+	lunix_sensors_destroy();
+	lunix_fleet_destroy();
+	lunix_stats_destroy();
 
 	printk(KERN_INFO "Lunix:TNG module unloaded successfully\n");
 }
@@ -114,7 +129,26 @@ MODULE_AUTHOR("Vangelis Koukis");
 MODULE_LICENSE("GPL");
 
 module_param(lunix_sensor_cnt, int, 0);
-MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support");
+MODULE_PARM_DESC(lunix_sensor_cnt, "Highest sensor node id to support, up to 65535");
+module_param(lunix_fleet, int, 0);
+MODULE_PARM_DESC(lunix_fleet, "Also keep the latest measurements of all sensors packed in one region, "
+	"mappable through /dev/lunix-fleet (default: 0)");
+module_param(lunix_wake_on_change, int, 0644);
+MODULE_PARM_DESC(lunix_wake_on_change, "Only wake up readers of a measurement when its value changes (default: 0)");
+module_param_array(lunix_agg_windows, int, NULL, 0444);
+MODULE_PARM_DESC(lunix_agg_windows, "Lengths in seconds of the windows to keep aggregates over (default: 1,10,60)");
+module_param(lunix_stream_len, int, 0644);
+MODULE_PARM_DESC(lunix_stream_len, "Samples queued for each reader in streaming mode, "
+	"rounded up to a power of two (default: 1024)");
+module_param(lunix_crc_check, int, 0644);
+MODULE_PARM_DESC(lunix_crc_check, "Drop XMesh packets with a bad CRC (default: 1)");
+module_param(lunix_ldisc_deferred, int, 0644);
+MODULE_PARM_DESC(lunix_ldisc_deferred, "Parse received data in batches from a workqueue, "
+	"instead of in the TTY receive path (default: 0)");
+module_param(lunix_ldisc_hiwat, int, 0644);
+MODULE_PARM_DESC(lunix_ldisc_hiwat, "Deferred mode: throttle the TTY once this many bytes are queued");
+module_param(lunix_ldisc_lowat, int, 0644);
+MODULE_PARM_DESC(lunix_ldisc_lowat, "Deferred mode: unthrottle the TTY once no more than this many bytes are queued");
 
 module_init(lunix_module_init);
 module_exit(lunix_module_cleanup);
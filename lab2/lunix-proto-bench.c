@@ -0,0 +1,183 @@
+/*
+ * lunix-proto-bench.c
+ *
+ * Replays a stream of XMesh packets through the Lunix:TNG
+ * protocol parser in userspace and reports on its speed.
+ *
+ * The stream is either synthetic, made of valid 0x0B sensor packets
+ * for a number of nodes, or recorded from a real base station, e.g. with
+ *
+ *	socat -u TCP:cerberus.cslab.ece.ntua.gr:49152 - >capture.bin
+ *
+ * It is built from the same lunix-protocol.c and lunix-sensors.c as the
+ * kernel module, on top of the shims in uspace/.
+ *
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "lunix.h"
+#include "lunix-xmesh.h"
+#include "lunix-stats.h"
+#include "lunix-protocol.h"
+
+/*
+ * Global state, as defined by lunix-module.c and lunix-stats.c in the kernel
+ */
+int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
+int lunix_crc_check = 1;
+int lunix_wake_on_change = 0;
+int lunix_agg_windows[LUNIX_AGG_NR_WINDOWS] = { 1, 10, 60 };
+DEFINE_XARRAY(lunix_sensors);
+struct lunix_fleet_entry *lunix_fleet_entries;
+atomic64_t lunix_sensors_gen;
+DEFINE_PER_CPU(struct lunix_stats_struct, lunix_stats);
+
+static unsigned char *make_stream(int npackets, int nodes, size_t *lenp)
+{
+	unsigned char *buf;
+	size_t len = 0;
+	int i;
+
+	buf = malloc((size_t)npackets * XMESH_MAX_ENCODED_LEN);
+	if (!buf)
+		return NULL;
+
+	srand(1);
+	for (i = 0; i < npackets; i++)
+		len += xmesh_encode_sensor_packet(&buf[len], 1 + i % nodes,
+			380 + rand() % 64, 480 + rand() % 64, rand() % 1024);
+
+	*lenp = len;
+	return buf;
+}
+
+static unsigned char *read_stream(const char *path, size_t *lenp)
+{
+	unsigned char *buf = NULL;
+	size_t len = 0, cap = 0;
+	size_t ret;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb"))) {
+		perror(path);
+		return NULL;
+	}
+	do {
+		if (len == cap) {
+			cap = cap ? 2 * cap : 1 << 20;
+			if (!(buf = realloc(buf, cap))) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		ret = fread(&buf[len], 1, cap - len, f);
+		len += ret;
+	} while (ret > 0);
+	fclose(f);
+
+	*lenp = len;
+	return buf;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-f capture] [-p packets] [-n nodes] [-c chunk] [-r rounds]\n\n"
+		"Replay an XMesh stream through lunix_protocol_received_buf().\n"
+		"  -f capture  replay the raw bytes in capture, instead of\n"
+		"              synthetic 0x0B packets\n"
+		"  -p packets  number of synthetic packets [100000]\n"
+		"  -n nodes    number of distinct synthetic node ids [16]\n"
+		"  -c chunk    bytes per call, as delivered by receive_buf [4096]\n"
+		"  -r rounds   number of times to replay the stream [20]\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct lunix_protocol_state_struct state;
+	struct lunix_sensor_struct *s;
+	unsigned long nodeid;
+	const char *path = NULL;
+	int npackets = 100000, nodes = 16, chunk = 4096, rounds = 20;
+	unsigned long packets;
+	unsigned char *buf;
+	size_t len, off;
+	double t0, t;
+	int opt, r;
+#ifdef HAVE_RDTSC
+	unsigned long long c0, cycles;
+#endif
+
+	while ((opt = getopt(argc, argv, "f:p:n:c:r:")) != -1) {
+		switch (opt) {
+		case 'f': path = optarg; break;
+		case 'p': npackets = atoi(optarg); break;
+		case 'n': nodes = atoi(optarg); break;
+		case 'c': chunk = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || npackets <= 0 || nodes <= 0 || chunk <= 0 || rounds <= 0)
+		usage(argv[0]);
+
+	buf = path ? read_stream(path, &len) : make_stream(npackets, nodes, &len);
+	if (!buf)
+		return 1;
+
+	if (!path && nodes > lunix_sensor_cnt)
+		lunix_sensor_cnt = nodes;
+	lunix_protocol_crc_init();
+	lunix_protocol_init(&state);
+
+	t0 = now();
+#ifdef HAVE_RDTSC
+	c0 = __rdtsc();
+#endif
+	for (r = 0; r < rounds; r++)
+		for (off = 0; off < len; off += chunk)
+			lunix_protocol_received_buf(&state, &buf[off], min_t(size_t, chunk, len - off));
+#ifdef HAVE_RDTSC
+	cycles = __rdtsc() - c0;
+#endif
+	t = now() - t0;
+
+	/* Every sensor update adds a sample to each of its measurements */
+	packets = 0;
+	xa_for_each(&lunix_sensors, nodeid, s)
+		packets += s->msr_data[BATT]->seq;
+
+	printf("replayed %zu bytes x %d rounds in %d-byte chunks\n", len, rounds, chunk);
+	printf("packets:        %lu accepted, %lu bad CRC, %lu framing errors, %lu ignored\n",
+		packets, state.crc_errors, state.framing_errors, state.ignored_packets);
+	printf("packets/s:      %.0f\n", packets / t);
+	printf("bytes/s:        %.0f\n", (double)len * rounds / t);
+	printf("ns/byte:        %.3f\n", t * 1e9 / ((double)len * rounds));
+#ifdef HAVE_RDTSC
+	printf("cycles/byte:    %.3f\n", (double)cycles / ((double)len * rounds));
+#endif
+
+	return 0;
+}
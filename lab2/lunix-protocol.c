@@ -18,6 +18,8 @@
 #include <asm/byteorder.h>
 
 #include "lunix.h"
+#include "lunix-stats.h"
+#include "lunix-trace.h"
 #include "lunix-protocol.h"
 
 /*
@@ -49,37 +51,171 @@ static inline void lunix_protocol_show_packet(struct lunix_protocol_state_struct
 }
 
 /*
- * Receives a complete XMesh packet and updates the node structures if
- * the packet contains sensor information. The function ignores other
- * types of packets. In future releases check packets with packet[4]
- * equal to 0x03, 0xFD for extending this function.
+ * CRC-16-CCITT (polynomial 0x1021, initial value 0, MSB first), as used
+ * by the XMesh serial framer. It covers all packet bytes between the
+ * start byte and the CRC itself and is transmitted little-endian.
+ *
+ * It is computed eight bytes at a time ("slicing-by-8"):
+ * lunix_crc_table[k][b] is the CRC of byte b followed by k zero bytes.
  */
-static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state, struct lunix_sensor_struct *lunix_sensors)
+static uint16_t lunix_crc_table[8][256] __read_mostly;
+
+void lunix_protocol_crc_init(void)
+{
+	int b, k, bit;
+	uint16_t crc;
+
+	for (b = 0; b < 256; b++) {
+		crc = b << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		lunix_crc_table[0][b] = crc;
+	}
+	for (k = 1; k < 8; k++)
+		for (b = 0; b < 256; b++) {
+			crc = lunix_crc_table[k - 1][b];
+			lunix_crc_table[k][b] = (crc << 8) ^ lunix_crc_table[0][crc >> 8];
+		}
+}
+
+static uint16_t lunix_protocol_crc16(const unsigned char *p, int len)
+{
+	uint16_t crc = 0;
+
+	for (; len >= 8; p += 8, len -= 8)
+		crc = lunix_crc_table[7][p[0] ^ (crc >> 8)] ^
+		      lunix_crc_table[6][p[1] ^ (crc & 0xFF)] ^
+		      lunix_crc_table[5][p[2]] ^ lunix_crc_table[4][p[3]] ^
+		      lunix_crc_table[3][p[4]] ^ lunix_crc_table[2][p[5]] ^
+		      lunix_crc_table[1][p[6]] ^ lunix_crc_table[0][p[7]];
+	for (; len > 0; p++, len--)
+		crc = (crc << 8) ^ lunix_crc_table[0][p[0] ^ (crc >> 8)];
+
+	return crc;
+}
+
+/*
+ * Receives a complete XMesh packet containing sensor information
+ * and updates the node structures.
+ */
+static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state,
+	const struct lunix_am_handler *h)
 {
 	uint16_t batt;
 	uint16_t temp;
 	uint16_t light;
 	uint16_t nodeid;
+	struct lunix_sensor_struct *sensor;
 
 	//debug("WHOLE PACKET\n");
 
-	if (0x0B == state->packet[PACKET_SIGNATURE_OFFSET])
-	{
-		nodeid = uint16_from_packet(&state->packet[NODE_OFFSET]);
-		batt = uint16_from_packet(&state->packet[VREF_OFFSET]);
-		temp = uint16_from_packet(&state->packet[TEMPERATURE_OFFSET]);
-		light = uint16_from_packet(&state->packet[LIGHT_OFFSET]);
-		
-		/* FIXME */
-		//debug ("I have the following raw data from nodeid = %d: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
-		//	nodeid, batt, temp, light);
-
-		if (nodeid > 0 && nodeid <= lunix_sensor_cnt)
-			lunix_sensor_update(&lunix_sensors[nodeid - 1], batt, temp, light);
-		else
-			printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
-				nodeid, lunix_sensor_cnt);
+	nodeid = uint16_from_packet(&state->packet[h->node_offset]);
+	batt = uint16_from_packet(&state->packet[h->vref_offset]);
+	temp = uint16_from_packet(&state->packet[h->temperature_offset]);
+	light = uint16_from_packet(&state->packet[h->light_offset]);
+	
+	/* FIXME */
+	//debug ("I have the following raw data from nodeid = %d: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
+	//	nodeid, batt, temp, light);
+
+	trace_lunix_sensor_update(nodeid, batt, temp, light);
+	if (nodeid == 0 || nodeid > lunix_sensor_cnt) {
+		printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
+			nodeid, lunix_sensor_cnt);
+		return;
+	}
+
+	/* Only allocates anything on the first packet from a node */
+	sensor = lunix_sensor_get_or_create(nodeid);
+	if (!sensor) {
+		printk(KERN_WARNING "Out of memory for sensor %d, dropping its measurements\n", nodeid);
+		return;
 	}
+
+	lunix_stat_inc(LUNIX_STAT_SENSOR_UPDATES);
+	lunix_sensor_update(sensor, batt, temp, light);
+	if (state->wake_pending)
+		__set_bit(nodeid - 1, state->wake_pending);
+	else
+		lunix_sensor_wake(sensor);
+}
+
+/*
+ * Packet types we know how to handle, indexed by AM type
+ * [packet[PACKET_SIGNATURE_OFFSET]]. Packets of any other type are
+ * dropped as soon as their AM type is known, without copying their
+ * payload. In future releases add entries for AM types 0x03 and 0xFD.
+ */
+static const struct lunix_am_handler lunix_am_sensor_handler = {
+	.handle = lunix_protocol_update_sensors,
+	.min_payload_length = LIGHT_OFFSET + 2 - 7,
+	.node_offset = NODE_OFFSET,
+	.vref_offset = VREF_OFFSET,
+	.temperature_offset = TEMPERATURE_OFFSET,
+	.light_offset = LIGHT_OFFSET
+};
+
+static const struct lunix_am_handler *const lunix_am_handlers[256] = {
+	[0x0B] = &lunix_am_sensor_handler
+};
+
+/*
+ * Looks up the handler for the packet whose header has just been
+ * received. Returns NULL if the packet is to be dropped.
+ */
+static const struct lunix_am_handler *lunix_protocol_find_handler(struct lunix_protocol_state_struct *state)
+{
+	const struct lunix_am_handler *h = lunix_am_handlers[state->packet[PACKET_SIGNATURE_OFFSET]];
+
+	if (h && state->packet[6] < h->min_payload_length)
+		h = NULL;
+	return h;
+}
+
+/*
+ * Wakes up the sleepers of all sensors updated since the last call,
+ * when wakeups are being batched.
+ */
+void lunix_protocol_flush_wakeups(struct lunix_protocol_state_struct *state)
+{
+	int bit;
+
+	if (!state->wake_pending)
+		return;
+
+	for_each_set_bit(bit, state->wake_pending, lunix_sensor_cnt) {
+		__clear_bit(bit, state->wake_pending);
+		lunix_sensor_wake(lunix_sensor_get(bit + 1));
+	}
+}
+
+/*
+ * Called once a whole XMesh packet has been received.
+ * Packets failing the CRC check are counted and dropped.
+ */
+static void lunix_protocol_packet_done(struct lunix_protocol_state_struct *state)
+{
+	int crc_pos = state->pos - 3;
+
+	if (!state->handler) {
+		state->ignored_packets++;
+		lunix_stat_inc(LUNIX_STAT_IGNORED);
+		trace_lunix_frame_drop(state, LUNIX_DROP_IGNORED);
+		return;
+	}
+
+	if (lunix_crc_check &&
+	    lunix_protocol_crc16(&state->packet[1], crc_pos - 1) != uint16_from_packet(&state->packet[crc_pos])) {
+		state->crc_errors++;
+		lunix_stat_inc(LUNIX_STAT_CRC_ERRORS);
+		trace_lunix_frame_drop(state, LUNIX_DROP_CRC);
+		debug("dropping packet with bad CRC, %lu so far\n", state->crc_errors);
+		return;
+	}
+
+	lunix_stat_inc(LUNIX_STAT_FRAMES);
+	trace_lunix_frame_complete(state, state->packet[PACKET_SIGNATURE_OFFSET], state->packet[6]);
+	state->handler->handle(state, state->handler);
 }
 
 /**********************************************************************************
@@ -114,8 +250,31 @@ static inline void set_state(struct lunix_protocol_state_struct *statep, int sta
  */
 void lunix_protocol_init(struct lunix_protocol_state_struct *state)
 {
+	state->crc_errors = 0;
+	state->framing_errors = 0;
+	state->ignored_packets = 0;
+	state->wake_pending = NULL;
+	state->handler = NULL;
+	state->discard = 0;
+	state->pos = 0;
+	state->next_is_special = 0;
+	set_state(state, SEEKING_START_BYTE, 1, 0);
+}
+
+/*
+ * Abandons the packet being received after a framing error.
+ * Input is skipped up to the next start byte.
+ */
+static void lunix_protocol_resync(struct lunix_protocol_state_struct *state)
+{
+	state->framing_errors++;
+	lunix_stat_inc(LUNIX_STAT_FRAMING_ERRORS);
+	trace_lunix_frame_drop(state, LUNIX_DROP_FRAMING);
+	debug("framing error, resynchronizing, %lu so far\n", state->framing_errors);
 	state->pos = 0;
 	state->next_is_special = 0;
+	state->handler = NULL;
+	state->discard = 0;
 	set_state(state, SEEKING_START_BYTE, 1, 0);
 }
 
@@ -133,12 +292,16 @@ void lunix_protocol_init(struct lunix_protocol_state_struct *state)
 static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 	const unsigned char *data, int length, int *i, int use_specials)
 {
+#if LUNIX_DEBUG
 	int iter;
+#endif
 
 	//debug("entering, for *i = %d, length = %d, state = %d, btr = %d, br = %d, next_is_special = %d\n",
 	//	*i, length, state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
 
+#if LUNIX_DEBUG
 	iter = 0;
+#endif
 	while ((*i < length) && (state->bytes_read < state->bytes_to_read))
 	{
 #if LUNIX_DEBUG
@@ -150,34 +313,41 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 		/* Prevent buffer overflows */
 		if (state->pos == MAX_PACKET_LEN) {
 			printk(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
-				"packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
-			printk(KERN_ERR "How will I ever resync with the input stream?\n");
-			state->pos = 0;
+				"packet buffer would overflow, resynchronizing\n", state->pos, MAX_PACKET_LEN);
+			lunix_protocol_resync(state);
 			return -1;
 		}
 
 		if (1 == use_specials)
 		{
+			/*
+			 * Start bytes are always escaped inside a packet, so this
+			 * one cuts the packet short and starts the next. It is left
+			 * in place, to be found again once resynchronized.
+			 */
+			if (0x7E == data[*i]) {
+				lunix_protocol_resync(state);
+				return -1;
+			}
 			if (state->next_is_special)
 			{
-				if (0x7E == state->next_is_special)
-					state->packet[state->pos] = data[*i];
-				if (0x7D == state->next_is_special)
-					state->packet[state->pos] = data[*i]^0x20;
-				++state->pos;
+				state->packet[state->pos] = data[*i]^0x20;
+				if (!state->discard)
+					++state->pos;
 				++state->bytes_read;
 				++(*i);
 				state->next_is_special = 0;
 			}
 			else
 			{
-				if ((0x7E == data[*i]) || (0x7D == data[*i]))
+				if (0x7D == data[*i])
 				{
 					state->next_is_special = data[*i];
 					++(*i);
 				} else {
 					state->packet[state->pos] = data[*i];
-					++state->pos;
+					if (!state->discard)
+						++state->pos;
 					++state->bytes_read;
 					++(*i);
 				}
@@ -203,6 +373,223 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 	return 0;
 }
 
+/*
+ * Word-at-a-time scanning for special characters. For a word v,
+ * lunix_word_has_zero(v) is non-zero iff at least one of its bytes is zero,
+ * so lunix_word_has_zero(v ^ LUNIX_WORD_REPEAT(c)) tells whether any
+ * byte of v equals c, without looking at the bytes one by one.
+ */
+#define LUNIX_WORD_ONES		(~0UL / 0xFF)
+#define LUNIX_WORD_REPEAT(c)	(LUNIX_WORD_ONES * (unsigned char)(c))
+
+static inline unsigned long lunix_word_has_zero(unsigned long v)
+{
+	return (v - LUNIX_WORD_ONES) & ~v & LUNIX_WORD_REPEAT(0x80);
+}
+
+/*
+ * Returns the number of bytes at the start of data[0..len)
+ * before the first special character (0x7E or 0x7D).
+ */
+static int lunix_protocol_plain_run(const unsigned char *data, int len)
+{
+	unsigned long v;
+	int n;
+
+	for (n = 0; n + (int)sizeof(v) <= len; n += sizeof(v)) {
+		memcpy(&v, &data[n], sizeof(v));
+		if (lunix_word_has_zero(v ^ LUNIX_WORD_REPEAT(0x7E)) |
+		    lunix_word_has_zero(v ^ LUNIX_WORD_REPEAT(0x7D)))
+			break;
+	}
+	for (; n < len; n++)
+		if ((0x7E == data[n]) || (0x7D == data[n]))
+			break;
+
+	return n;
+}
+
+/*
+ * Returns the offset of the first start byte (0x7E) in data[0..len),
+ * or len if there is none.
+ */
+static int lunix_protocol_find_start(const unsigned char *data, int len)
+{
+	unsigned long v;
+	int n;
+
+	for (n = 0; n + (int)sizeof(v) <= len; n += sizeof(v)) {
+		memcpy(&v, &data[n], sizeof(v));
+		if (lunix_word_has_zero(v ^ LUNIX_WORD_REPEAT(0x7E)))
+			break;
+	}
+	for (; n < len; n++)
+		if (0x7E == data[n])
+			break;
+
+	return n;
+}
+
+/*
+ * Copies escaped input from *p into the packet buffer, until
+ * state->pos reaches target. Runs of plain bytes are copied
+ * with a single memcpy(). Returns 0 if the input ran out first,
+ * or -1, with *p at the start byte, if an unescaped start byte
+ * cut the packet short.
+ */
+static int lunix_protocol_fast_unescape(struct lunix_protocol_state_struct *state,
+	const unsigned char **p, const unsigned char *end, int target)
+{
+	const unsigned char *q = *p;
+	int run;
+
+	while (state->pos < target) {
+		run = lunix_protocol_plain_run(q, min_t(int, end - q, target - state->pos));
+		memcpy(&state->packet[state->pos], q, run);
+		state->pos += run;
+		q += run;
+
+		if (state->pos == target)
+			break;
+		if (q == end)
+			return 0;
+		if (0x7E == q[0])
+			goto out_cut_short;
+		if (end - q < 2)
+			return 0;
+		if (0x7E == q[1]) {
+			q++;
+			goto out_cut_short;
+		}
+		state->packet[state->pos++] = q[1] ^ 0x20;
+		q += 2;
+	}
+
+	*p = q;
+	return 1;
+
+out_cut_short:
+	*p = q;
+	return -1;
+}
+
+/*
+ * Like lunix_protocol_fast_unescape(), but skips cnt unescaped
+ * bytes of a packet nobody is interested in, without storing them.
+ */
+static int lunix_protocol_fast_skip(const unsigned char **p, const unsigned char *end, int cnt)
+{
+	const unsigned char *q = *p;
+	int run;
+
+	while (cnt > 0) {
+		run = lunix_protocol_plain_run(q, min_t(int, end - q, cnt));
+		cnt -= run;
+		q += run;
+
+		if (cnt == 0)
+			break;
+		if (q == end)
+			return 0;
+		if (0x7E == q[0])
+			goto out_cut_short;
+		if (end - q < 2)
+			return 0;
+		if (0x7E == q[1]) {
+			q++;
+			goto out_cut_short;
+		}
+		cnt--;
+		q += 2;
+	}
+
+	*p = q;
+	return 1;
+
+out_cut_short:
+	*p = q;
+	return -1;
+}
+
+/*
+ * Fast path: if a whole packet is available in buf[*i..length),
+ * decode it in one go, bypassing the per-byte state machine, and
+ * return 1. Otherwise return 0 and leave it to the state machine,
+ * which also handles packets spanning more than one call.
+ *
+ * Must only be called with buf[*i] being a start byte.
+ */
+static int lunix_protocol_fast_packet(struct lunix_protocol_state_struct *state,
+	const unsigned char *buf, int length, int *i)
+{
+	const unsigned char *p = &buf[*i];
+	const unsigned char *end = &buf[length];
+	int ret;
+
+	/* Of consecutive start bytes, the last one starts the packet */
+	while (end - p >= 2 && 0x7E == p[1])
+		p++;
+	*i = p - buf;
+
+	/* Too short to hold even an empty packet */
+	if (end - p < 10)
+		return 0;
+
+	/* Start byte and packet type are never escaped */
+	state->packet[0] = p[0];
+	state->packet[1] = p[1];
+	state->pos = 2;
+	p += 2;
+
+	/* Destination address, AM type, AM group, payload length */
+	ret = lunix_protocol_fast_unescape(state, &p, end, 7);
+	if (ret < 0)
+		goto cut_short;
+	if (ret == 0)
+		goto fallback;
+	if (state->packet[6] > MAX_PAYLOAD_LEN) {
+		lunix_protocol_resync(state);
+		*i = p - buf;
+		return 1;
+	}
+	/* Payload and CRC, unless the packet is to be dropped anyway */
+	state->handler = lunix_protocol_find_handler(state);
+	if (state->handler)
+		ret = lunix_protocol_fast_unescape(state, &p, end, 7 + state->packet[6] + 2);
+	else
+		ret = lunix_protocol_fast_skip(&p, end, state->packet[6] + 2);
+	if (ret < 0)
+		goto cut_short;
+	if (ret == 0)
+		goto fallback;
+	/* End byte */
+	if (p == end)
+		goto fallback;
+	state->packet[state->pos++] = *p++;
+	*i = p - buf;
+
+	if (0x7E != state->packet[state->pos - 1]) {
+		lunix_protocol_resync(state);
+		return 1;
+	}
+
+	lunix_protocol_packet_done(state);
+	state->pos = 0;
+	state->handler = NULL;
+	return 1;
+
+cut_short:
+	/* By a start byte, which begins the next packet */
+	lunix_protocol_resync(state);
+	*i = p - buf;
+	return 1;
+
+fallback:
+	state->pos = 0;
+	state->handler = NULL;
+	return 0;
+}
+
 /*
  * This function gets called for incoming data
  * to update the protocol state machine.
@@ -216,50 +603,84 @@ int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
 
 	i = 0;
 
-	if (state->state == SEEKING_START_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
-
-
-	if (state->state == SEEKING_PACKET_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
-
-	if (state->state == SEEKING_DESTINATION_ADDRESS) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_TYPE, 1, 0);
+	/*
+	 * A single call may carry many packets,
+	 * keep going until all of them have been consumed.
+	 */
+	while (i < length) {
+		if (state->state == SEEKING_START_BYTE) {
+			/* Skip everything up to the next start byte */
+			i += lunix_protocol_find_start(&buf[i], length - i);
+			if (i == length)
+				break;
+			trace_lunix_frame_start(state);
+			if (lunix_protocol_fast_packet(state, buf, length, &i))
+				continue;
+		}
 
-	if (state->state == SEEKING_AM_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_GROUP, 1, 0);
+		if (state->state == SEEKING_START_BYTE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
+				set_state(state, SEEKING_PACKET_TYPE, 1, 0);
 
-	if (state->state == SEEKING_AM_GROUP) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
 
-	if (state->state == SEEKING_PAYLOAD_LENGTH) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
-			payload_length = state->packet[state->pos - 1];
-			set_state(state, SEEKING_PAYLOAD, payload_length, 0);
+		if (state->state == SEEKING_PACKET_TYPE) {
+			/* Of consecutive start bytes, the last one starts the packet */
+			while (i < length && 0x7E == buf[i])
+				++i;
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
+				set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
 		}
 
-	if (state->state == SEEKING_PAYLOAD) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_CRC, 2, 0);
+		if (state->state == SEEKING_DESTINATION_ADDRESS) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_AM_TYPE, 1, 0);
+
+		if (state->state == SEEKING_AM_TYPE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_AM_GROUP, 1, 0);
+
+		if (state->state == SEEKING_AM_GROUP) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
+
+		if (state->state == SEEKING_PAYLOAD_LENGTH) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
+				payload_length = state->packet[state->pos - 1];
+				if (payload_length > MAX_PAYLOAD_LEN)
+					lunix_protocol_resync(state);
+				else {
+					/* Unless someone handles this packet, only skip over the rest */
+					state->handler = lunix_protocol_find_handler(state);
+					state->discard = !state->handler;
+					set_state(state, SEEKING_PAYLOAD, payload_length, 0);
+				}
+			}
+
+		if (state->state == SEEKING_PAYLOAD) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_CRC, 2, 0);
 
-	if (state->state == SEEKING_CRC) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_END_BYTE, 1, 0);
+		if (state->state == SEEKING_CRC) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
+				state->discard = 0;
+				set_state(state, SEEKING_END_BYTE, 1, 0);
+			}
 
-	if (state->state == SEEKING_END_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
-			//debug("An XMesh packet has been received, updating sensors\n");
+		if (state->state == SEEKING_END_BYTE) 
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+				//debug("An XMesh packet has been received, updating sensors\n");
 
-			lunix_protocol_update_sensors(state, lunix_sensors);
-			state->pos = 0;
-			state->next_is_special = 0;
-			set_state(state, SEEKING_START_BYTE, 1, 0);
-		}
+				if (0x7E != state->packet[state->pos - 1]) {
+					lunix_protocol_resync(state);
+					continue;
+				}
+				lunix_protocol_packet_done(state);
+				state->pos = 0;
+				state->next_is_special = 0;
+				state->handler = NULL;
+				set_state(state, SEEKING_START_BYTE, 1, 0);
+			}
+	}
 
 	//debug("leaving\n");
 
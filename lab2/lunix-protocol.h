@@ -13,18 +13,19 @@
 #ifndef _LUNIX_PROTOCOL_H
 #define _LUNIX_PROTOCOL_H
 
-#ifdef __KERNEL__ 
-
 /*
  * Application/Protocol specific constants
  */
 #define MAX_PACKET_LEN 300
+#define MAX_PAYLOAD_LEN (MAX_PACKET_LEN - 10) /* Header, CRC and end byte take 10 bytes */
 #define PACKET_SIGNATURE_OFFSET 4
 #define NODE_OFFSET 9
 #define VREF_OFFSET 18
 #define TEMPERATURE_OFFSET 20
 #define LIGHT_OFFSET 22
 
+#ifdef __KERNEL__ 
+
 /*
  * States of the Lunix protocol state machine
  */
@@ -41,6 +42,22 @@
 /*
  * Current state of the Lunix protocol state machine
  */
+struct lunix_protocol_state_struct;
+
+/*
+ * Handler for a type of XMesh packet, along with where
+ * the fields it is interested in lie in the packet
+ */
+struct lunix_am_handler
+{
+	void (*handle)(struct lunix_protocol_state_struct *, const struct lunix_am_handler *);
+	int min_payload_length;         /* Shorter packets are dropped */
+	int node_offset;
+	int vref_offset;
+	int temperature_offset;
+	int light_offset;
+};
+
 struct lunix_protocol_state_struct
 {
 	int state;                      /* The current state of the protocol state machine */
@@ -51,13 +68,29 @@ struct lunix_protocol_state_struct
 	unsigned char next_is_special;  /* The next character to be received is a special character */
 	unsigned char payload_length;   /* The length of the payload of the received packet */
 	unsigned char packet[MAX_PACKET_LEN]; /* The XMesh packet being received */
+
+	const struct lunix_am_handler *handler; /* Handler for its AM type, NULL if it is to be dropped */
+	int discard;                    /* Skip over the bytes being received instead of storing them */
+
+	unsigned long crc_errors;       /* Number of packets dropped due to a bad CRC */
+	unsigned long framing_errors;   /* Number of times we had to resync with the input stream */
+	unsigned long ignored_packets;  /* Number of packets of AM types nobody handles */
+
+	/*
+	 * If not NULL, a bitmap of sensors updated since the last call to
+	 * lunix_protocol_flush_wakeups(). Their sleepers are woken up
+	 * only then, instead of once per packet.
+	 */
+	unsigned long *wake_pending;
 };
 
 /*
  * Function prototypes
  */
+void lunix_protocol_crc_init(void);
 void lunix_protocol_init(struct lunix_protocol_state_struct *);
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *, const unsigned char *buf, int count);
+void lunix_protocol_flush_wakeups(struct lunix_protocol_state_struct *);
 
 #endif	/* __KERNEL__ */
 
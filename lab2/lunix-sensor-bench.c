@@ -0,0 +1,163 @@
+/*
+ * lunix-sensor-bench.c
+ *
+ * Measures how reads of a Lunix:TNG sensor scale with the number
+ * of concurrent readers, while a single writer keeps updating it,
+ * as the line discipline would.
+ *
+ * Readers go through lunix_sensor_snapshot(), the same path
+ * the character device takes on every read(). It is built from the
+ * same lunix-sensors.c as the kernel module, on top of the shims
+ * in uspace/.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "lunix.h"
+#include "lunix-stats.h"
+
+/*
+ * Global state, as defined by lunix-module.c and lunix-stats.c in the kernel
+ */
+int lunix_sensor_cnt = 1;
+int lunix_wake_on_change = 0;
+int lunix_agg_windows[LUNIX_AGG_NR_WINDOWS] = { 1, 10, 60 };
+DEFINE_XARRAY(lunix_sensors);
+struct lunix_fleet_entry *lunix_fleet_entries;
+atomic64_t lunix_sensors_gen;
+DEFINE_PER_CPU(struct lunix_stats_struct, lunix_stats);
+
+/* The writer updates the sensor in batches, once per tick */
+#define TICK_NS		1000000L
+
+static struct lunix_sensor_struct *sensor;
+static volatile int running;
+static double rate;
+
+/* Per-thread counters, each in its own cache line */
+struct counter {
+	unsigned long n;
+} __attribute__((aligned(64)));
+
+static struct counter *reads;
+static struct counter updates;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *arg)
+{
+	struct timespec tick = { 0, TICK_NS };
+	double t0 = now();
+	unsigned long due;
+	uint16_t v = 0;
+
+	while (running) {
+		/* Flat out if no rate was given, at the given rate otherwise */
+		due = rate > 0 ? (unsigned long)((now() - t0) * rate) : updates.n + 1000;
+		for (; updates.n < due; updates.n++, v++)
+			lunix_sensor_update(sensor, v, v, v);
+		if (rate > 0)
+			nanosleep(&tick, NULL);
+	}
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct counter *c = arg;
+	struct lunix_msr_snapshot snap;
+	unsigned long n = 0;
+
+	while (running) {
+		lunix_sensor_snapshot(sensor, TEMP, &snap);
+		n++;
+	}
+	c->n = n;
+	return NULL;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-t threads] [-w rate] [-d seconds]\n\n"
+		"Run 1 to threads concurrent readers of a sensor, against one writer.\n"
+		"  -t threads  maximum number of readers [number of CPUs - 1]\n"
+		"  -w rate     writer updates per second, 0 for flat out [10000]\n"
+		"  -d seconds  duration of each run [1]\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t wthread, *rthreads;
+	int threads, opt, i, t;
+	double duration = 1, t0, el;
+	unsigned long total;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (threads < 1)
+		threads = 1;
+	rate = 10000;
+
+	while ((opt = getopt(argc, argv, "t:w:d:")) != -1) {
+		switch (opt) {
+		case 't': threads = atoi(optarg); break;
+		case 'w': rate = atof(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || threads <= 0 || rate < 0 || duration <= 0)
+		usage(argv[0]);
+
+	if (!(sensor = lunix_sensor_get_or_create(1))) {
+		fprintf(stderr, "Failed to initialize sensor\n");
+		return 1;
+	}
+	rthreads = calloc(threads, sizeof(*rthreads));
+	reads = aligned_alloc(64, threads * sizeof(*reads));
+	if (!rthreads || !reads) {
+		perror("malloc");
+		return 1;
+	}
+
+	printf("%8s %14s %14s %14s\n", "readers", "reads/s", "reads/s/reader", "updates/s");
+	for (t = 1; t <= threads; t++) {
+		running = 1;
+		updates.n = 0;
+		t0 = now();
+		pthread_create(&wthread, NULL, writer, NULL);
+		for (i = 0; i < t; i++)
+			pthread_create(&rthreads[i], NULL, reader, &reads[i]);
+
+		usleep(duration * 1e6);
+		running = 0;
+		for (i = 0; i < t; i++)
+			pthread_join(rthreads[i], NULL);
+		pthread_join(wthread, NULL);
+		el = now() - t0;
+
+		for (total = 0, i = 0; i < t; i++)
+			total += reads[i].n;
+		printf("%8d %14.0f %14.0f %14.0f\n", t, total / el, total / el / t, updates.n / el);
+	}
+
+	lunix_sensors_destroy();
+	return 0;
+}
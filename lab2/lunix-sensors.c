@@ -18,12 +18,38 @@
 #include <linux/ioctl.h>
 #include <linux/types.h>
 #include <linux/module.h>
+#include <linux/ktime.h>
 #include <linux/kernel.h>
+#include <linux/math64.h>
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
+#include <linux/seqlock.h>
 #include <linux/spinlock.h>
 
 #include "lunix.h"
+#include "lunix-stats.h"
+#include "lunix-trace.h"
+#include "lunix-lookup.h"
+
+/*
+ * Converts a raw 16-bit value of a measurement to
+ * thousandths of its unit, using the lookup tables.
+ * Values out of range of the ADC read as its maximum.
+ */
+long lunix_msr_convert(enum lunix_msr_enum type, uint32_t data)
+{
+	switch (type) {
+	case BATT:
+		return lookup_voltage[min_t(uint32_t, data, LOOKUP_ADC_SZ - 1)];
+	case TEMP:
+		return lookup_temperature[min_t(uint32_t, data, LOOKUP_ADC_SZ - 1)];
+	case LIGHT:
+		/* Linear, over the full 16-bit range */
+		return div_u64((uint64_t)data * 5000000, 65535);
+	default:
+		return 0;
+	}
+}
 
 /*
  * Initialization and destruction of sensor structures
@@ -37,17 +63,22 @@ int lunix_sensor_init(struct lunix_sensor_struct *s)
 	/*
 	 * Initialize structure fields
 	 */
-	spin_lock_init(&s->lock);
-	init_waitqueue_head(&s->wq);
+	seqlock_init(&s->lock);
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		init_waitqueue_head(&s->wq[i]);
+	atomic_set(&s->wake_mask, 0);
+	INIT_LIST_HEAD(&s->streams);
 
 	/*
-	 * Allocate one page per measurement buffer
+	 * Allocate 1 << LUNIX_MSR_ORDER pages per measurement buffer
 	 */
+	BUILD_BUG_ON(sizeof(struct lunix_msr_data_struct) > (PAGE_SIZE << LUNIX_MSR_ORDER));
+
 	for (i = 0; i < N_LUNIX_MSR; i++)
 		s->msr_data[i] = NULL;
 
 	for (i = 0; i < N_LUNIX_MSR; i++) {
-		p = get_zeroed_page(GFP_KERNEL);
+		p = __get_free_pages(GFP_KERNEL | __GFP_ZERO, LUNIX_MSR_ORDER);
 		if (!p) {
 			ret = -ENOMEM;
 			goto out;
@@ -67,30 +98,451 @@ void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 
 	for (i = 0; i < N_LUNIX_MSR; i++) {
 		if (s->msr_data[i])
-			free_page((unsigned long)s->msr_data[i]);
+			free_pages((unsigned long)s->msr_data[i], LUNIX_MSR_ORDER);
+	}
+}
+
+/*
+ * Formats a value in thousandths of a unit as text, "[-]int.ddd\n",
+ * copying digits three at a time out of lookup_digits[].
+ * buf must have room for LUNIX_MSR_TEXT_MAX bytes; returns the length.
+ */
+int lunix_msr_format(char *buf, long value)
+{
+	unsigned long v = value < 0 ? -(unsigned long)value : value;
+	unsigned int frac = v % 1000, groups[7], n = 0, skip;
+	char *p = buf;
+
+	/* The integer part, three digits at a time, least significant first */
+	v /= 1000;
+	do {
+		groups[n++] = v % 1000;
+		v /= 1000;
+	} while (v);
+
+	if (value < 0)
+		*p++ = '-';
+
+	/* No leading zeros on the most significant group */
+	n--;
+	skip = groups[n] >= 100 ? 0 : groups[n] >= 10 ? 1 : 2;
+	memcpy(p, &lookup_digits[groups[n]][skip], 3 - skip);
+	p += 3 - skip;
+	while (n--) {
+		memcpy(p, lookup_digits[groups[n]], 3);
+		p += 3;
+	}
+
+	*p++ = '.';
+	memcpy(p, lookup_digits[frac], 3);
+	p += 3;
+	*p++ = '\n';
+
+	return p - buf;
+}
+
+/*
+ * Returns the sensor for a node id, allocating it the first time
+ * the node reports in or one of its device nodes is opened.
+ * Returns NULL if out of memory. May sleep.
+ *
+ * Sensors are only freed when the module is unloaded, so the
+ * pointer returned stays valid for as long as the module is loaded.
+ */
+struct lunix_sensor_struct *lunix_sensor_get_or_create(unsigned int nodeid)
+{
+	struct lunix_sensor_struct *s, *old;
+
+	s = lunix_sensor_get(nodeid);
+	if (likely(s))
+		return s;
+
+	debug("allocating sensor %u\n", nodeid);
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+	s->nodeid = nodeid;
+	if (lunix_sensor_init(s) < 0)
+		goto out_with_sensor;
+
+	/* Another TTY or reader may have beaten us to it */
+	old = xa_cmpxchg(&lunix_sensors, nodeid, NULL, s, GFP_KERNEL);
+	if (old) {
+		lunix_sensor_destroy(s);
+		kfree(s);
+		return xa_is_err(old) ? NULL : old;
+	}
+	return s;
+
+out_with_sensor:
+	lunix_sensor_destroy(s);
+	kfree(s);
+	return NULL;
+}
+
+/*
+ * Frees all sensors, on module unload
+ */
+void lunix_sensors_destroy(void)
+{
+	struct lunix_sensor_struct *s;
+	unsigned long nodeid;
+
+	xa_for_each(&lunix_sensors, nodeid, s) {
+		lunix_sensor_destroy(s);
+		kfree(s);
 	}
+	xa_destroy(&lunix_sensors);
 }
 
+/*
+ * Appends a sample to the history ring of a measurement.
+ * Returns 1 if its value differs from the previous one.
+ *
+ * The buffer may be mapped to userspace, where the seqlock is of
+ * no help, so it has a sequence of its own, odd while it is being
+ * updated, as entries of the fleet region do.
+ */
+static int lunix_msr_push(struct lunix_msr_data_struct *m, uint32_t value,
+	uint32_t timestamp, uint64_t timestamp_ns)
+{
+	uint32_t head = m->head;
+	int changed;
+
+	changed = m->seq == 0 ||
+		m->values[(head + LUNIX_MSR_HIST_LEN - 1) % LUNIX_MSR_HIST_LEN] != value;
+
+	WRITE_ONCE(m->sequence, m->sequence + 1);
+	smp_wmb();
+	m->timestamps[head] = timestamp;
+	m->values[head] = value;
+	WRITE_ONCE(m->head, (head + 1 == LUNIX_MSR_HIST_LEN) ? 0 : head + 1);
+	m->magic = LUNIX_MSR_MAGIC;
+	m->last_update = timestamp;
+	m->last_update_ns = timestamp_ns;
+	WRITE_ONCE(m->seq, m->seq + 1);
+	smp_wmb();
+	WRITE_ONCE(m->sequence, m->sequence + 1);
+	return changed;
+}
+
+/*
+ * Adds a sample to the aggregates of a measurement over all
+ * windows. Once a window is over, it is kept as agg_prev and
+ * a new one is started.
+ */
+static void lunix_agg_push(struct lunix_agg_struct *agg, struct lunix_agg_struct *agg_prev,
+	int32_t value, uint32_t timestamp)
+{
+	int i;
+
+	for (i = 0; i < LUNIX_AGG_NR_WINDOWS; i++, agg++, agg_prev++) {
+		/* Also starts over if the clock went back */
+		if (agg->count == 0 || timestamp - agg->start >= lunix_agg_windows[i]) {
+			if (agg->count)
+				*agg_prev = *agg;
+			agg->start = timestamp - timestamp % lunix_agg_windows[i];
+			agg->count = 1;
+			agg->min = agg->max = value;
+			agg->sum = value;
+			continue;
+		}
+		agg->count++;
+		agg->min = min(agg->min, value);
+		agg->max = max(agg->max, value);
+		agg->sum += value;
+	}
+}
+
+/*
+ * Mirrors the latest measurements of a sensor into its entry
+ * of the fleet region. Serialized by the sensor lock.
+ */
+static void lunix_fleet_update(struct lunix_sensor_struct *s)
+{
+	struct lunix_fleet_entry *e = &lunix_fleet_entries[s->nodeid];
+	struct lunix_msr_data_struct *m = s->msr_data[BATT];
+	uint32_t last = (m->head + LUNIX_MSR_HIST_LEN - 1) % LUNIX_MSR_HIST_LEN;
+
+	WRITE_ONCE(e->sequence, e->sequence + 1);
+	smp_wmb();
+	e->nodeid = s->nodeid;
+	e->batt = s->msr_data[BATT]->values[last];
+	e->temp = s->msr_data[TEMP]->values[last];
+	e->light = s->msr_data[LIGHT]->values[last];
+	e->last_update = m->last_update;
+	e->seq = m->seq;
+	e->last_update_ns = m->last_update_ns;
+	smp_wmb();
+	WRITE_ONCE(e->sequence, e->sequence + 1);
+}
+
+/*
+ * Queues the sample just stored for every reader in streaming mode.
+ * Serialized by the sensor lock. Returns the mask of measurements
+ * that got queued, whose readers are to be woken up.
+ */
+static int lunix_stream_push(struct lunix_sensor_struct *s)
+{
+	struct lunix_stream_struct *st;
+	struct lunix_msr_data_struct *m;
+	struct lunix_msr_snapshot snap;
+	int queued = 0;
+
+	list_for_each_entry(st, &s->streams, list) {
+		m = s->msr_data[st->type];
+		snap.value = m->values[(m->head + LUNIX_MSR_HIST_LEN - 1) % LUNIX_MSR_HIST_LEN];
+		snap.seq = m->seq;
+		snap.timestamp = m->last_update;
+		snap.timestamp_ns = m->last_update_ns;
+
+		spin_lock(&st->lock);
+		if (kfifo_is_full(&st->fifo)) {
+			st->drops++;
+			lunix_stat_inc(LUNIX_STAT_STREAM_DROPS);
+			if (READ_ONCE(st->drop_newest)) {
+				spin_unlock(&st->lock);
+				continue;
+			}
+			kfifo_skip(&st->fifo);
+		}
+		kfifo_put(&st->fifo, snap);
+		spin_unlock(&st->lock);
+		queued |= 1 << st->type;
+	}
+	return queued;
+}
+
+/*
+ * May run concurrently for the same sensor on behalf of different TTYs.
+ * All values of a packet are stored under the sensor seqlock, so readers
+ * always see a consistent set of measurements from a single packet.
+ */
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light)
 {
-	spin_lock(&s->lock);
+	uint32_t now = get_seconds();
+	uint64_t now_ns = ktime_get_ns();
+	int changed = 0, queued = 0;
+
+	write_seqlock(&s->lock);
 	
+	s->gen = atomic64_inc_return(&lunix_sensors_gen);
+
 	/*
-	 * Update the raw values and the relevant timestamps.
+	 * Append the raw values and the relevant timestamps.
 	 */
-	s->msr_data[BATT]->values[0] = batt;
-	s->msr_data[TEMP]->values[0] = temp;
-	s->msr_data[LIGHT]->values[0] = light;
-
-	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;
-	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = get_seconds();
+	changed |= lunix_msr_push(s->msr_data[BATT], batt, now, now_ns) << BATT;
+	changed |= lunix_msr_push(s->msr_data[TEMP], temp, now, now_ns) << TEMP;
+	changed |= lunix_msr_push(s->msr_data[LIGHT], light, now, now_ns) << LIGHT;
+	lunix_agg_push(s->agg[BATT], s->agg_prev[BATT], lunix_msr_convert(BATT, batt), now);
+	lunix_agg_push(s->agg[TEMP], s->agg_prev[TEMP], lunix_msr_convert(TEMP, temp), now);
+	lunix_agg_push(s->agg[LIGHT], s->agg_prev[LIGHT], lunix_msr_convert(LIGHT, light), now);
+	if (lunix_fleet_entries)
+		lunix_fleet_update(s);
+	if (!list_empty(&s->streams))
+		queued = lunix_stream_push(s);
 	
-	spin_unlock(&s->lock);
+	write_sequnlock(&s->lock);
 
 	/*
-	 * And wake up any sleepers who may be waiting on
-	 * fresh data from this sensor.
+	 * Readers of a measurement are woken up on every update,
+	 * or only if its value changed, in wake-on-change mode.
+	 * Streaming readers always are, they want every sample.
 	 */
-	wake_up_interruptible(&s->wq);
+	if (!lunix_wake_on_change)
+		changed = (1 << N_LUNIX_MSR) - 1;
+	changed |= queued;
+	if (changed)
+		atomic_or(changed, &s->wake_mask);
+}
+
+/*
+ * Reads the most recent sample of a measurement along with its
+ * sequence number and timestamps, without ever taking the sensor lock.
+ * Retries if lunix_sensor_update() changed the sensor meanwhile.
+ */
+void lunix_sensor_snapshot(struct lunix_sensor_struct *s, enum lunix_msr_enum type,
+	struct lunix_msr_snapshot *snap)
+{
+	struct lunix_msr_data_struct *m = s->msr_data[type];
+	unsigned int lock_seq;
+
+	do {
+		lock_seq = read_seqbegin(&s->lock);
+		/* head may be stale here, but is always in range */
+		snap->value = m->values[(READ_ONCE(m->head) + LUNIX_MSR_HIST_LEN - 1) % LUNIX_MSR_HIST_LEN];
+		snap->seq = m->seq;
+		snap->timestamp = m->last_update;
+		snap->timestamp_ns = m->last_update_ns;
+	} while (read_seqretry(&s->lock, lock_seq));
+}
+
+/*
+ * Returns the sequence number of the most recent sample of a
+ * measurement, which cannot be read in one go on 32-bit machines
+ */
+uint64_t lunix_sensor_seq(struct lunix_sensor_struct *s, enum lunix_msr_enum type)
+{
+	unsigned int lock_seq;
+	uint64_t seq;
+
+	do {
+		lock_seq = read_seqbegin(&s->lock);
+		seq = s->msr_data[type]->seq;
+	} while (read_seqretry(&s->lock, lock_seq));
+
+	return seq;
+}
+
+/*
+ * Allocates a queue for up to len samples of a measurement,
+ * rounded up to a power of two. Returns NULL if out of memory.
+ * May sleep.
+ */
+struct lunix_stream_struct *lunix_stream_create(enum lunix_msr_enum type, unsigned int len)
+{
+	struct lunix_stream_struct *st;
+
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return NULL;
+	if (kfifo_alloc(&st->fifo, len, GFP_KERNEL) < 0) {
+		kfree(st);
+		return NULL;
+	}
+	st->type = type;
+	spin_lock_init(&st->lock);
+	return st;
+}
+
+void lunix_stream_destroy(struct lunix_stream_struct *st)
+{
+	kfifo_free(&st->fifo);
+	kfree(st);
+}
+
+/*
+ * Starts queueing every sample of the measurement from now on,
+ * on an empty queue, and stops. The queue may only be drained
+ * while attached, by a single reader at a time.
+ */
+void lunix_stream_attach(struct lunix_sensor_struct *s, struct lunix_stream_struct *st)
+{
+	write_seqlock(&s->lock);
+	list_add_tail(&st->list, &s->streams);
+	write_sequnlock(&s->lock);
+}
+
+/*
+ * Throws away whatever is left queued, along with the count of drops,
+ * once nothing more can be pushed. A reader may still be draining it.
+ */
+void lunix_stream_detach(struct lunix_sensor_struct *s, struct lunix_stream_struct *st)
+{
+	write_seqlock(&s->lock);
+	list_del(&st->list);
+	write_sequnlock(&s->lock);
+
+	spin_lock(&st->lock);
+	kfifo_reset(&st->fifo);
+	st->drops = 0;
+	spin_unlock(&st->lock);
+}
+
+/*
+ * Takes up to n samples off a stream, oldest first,
+ * and returns how many there were
+ */
+unsigned int lunix_stream_out(struct lunix_stream_struct *st,
+	struct lunix_msr_snapshot *snaps, unsigned int n)
+{
+	unsigned int ret;
+
+	spin_lock(&st->lock);
+	ret = kfifo_out(&st->fifo, snaps, n);
+	spin_unlock(&st->lock);
+
+	return ret;
+}
+
+uint64_t lunix_stream_drops(struct lunix_stream_struct *st)
+{
+	uint64_t drops;
+
+	spin_lock(&st->lock);
+	drops = st->drops;
+	spin_unlock(&st->lock);
+
+	return drops;
+}
+
+/*
+ * Fills in the /dev/lunix-all entry of a sensor, with its latest
+ * measurements, if it was updated after generation since.
+ * Returns 0, leaving the values in e undefined, if it was not.
+ */
+int lunix_sensor_all_entry(struct lunix_sensor_struct *s, uint64_t since,
+	struct lunix_all_entry *e)
+{
+	unsigned int lock_seq, last;
+	int i;
+
+	do {
+		lock_seq = read_seqbegin(&s->lock);
+		e->gen = s->gen;
+		/* All measurements are pushed together, their heads agree */
+		last = (READ_ONCE(s->msr_data[BATT]->head) + LUNIX_MSR_HIST_LEN - 1) % LUNIX_MSR_HIST_LEN;
+		for (i = 0; i < N_LUNIX_MSR; i++)
+			e->raw[i] = s->msr_data[i]->values[last];
+		e->last_update = s->msr_data[BATT]->last_update;
+		e->last_update_ns = s->msr_data[BATT]->last_update_ns;
+	} while (read_seqretry(&s->lock, lock_seq));
+
+	if (e->gen <= since)
+		return 0;
+
+	e->nodeid = s->nodeid;
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		e->value[i] = lunix_msr_convert(i, e->raw[i]);
+	return 1;
+}
+
+/*
+ * Copies out the aggregates of a measurement over all windows,
+ * as last updated. Windows that have ended since are left as they are.
+ */
+void lunix_sensor_aggregates(struct lunix_sensor_struct *s, enum lunix_msr_enum type,
+	struct lunix_agg_struct *agg, struct lunix_agg_struct *agg_prev)
+{
+	unsigned int lock_seq;
+
+	do {
+		lock_seq = read_seqbegin(&s->lock);
+		memcpy(agg, s->agg[type], sizeof(s->agg[type]));
+		memcpy(agg_prev, s->agg_prev[type], sizeof(s->agg_prev[type]));
+	} while (read_seqretry(&s->lock, lock_seq));
+}
+
+/*
+ * Wakes up any sleepers who may be waiting on fresh data
+ * from this sensor, on the measurements that have wakeups
+ * pending. Called after one or more calls to lunix_sensor_update().
+ *
+ * Only a single exclusive waiter per measurement is woken up,
+ * along with all the others.
+ */
+void lunix_sensor_wake(struct lunix_sensor_struct *s)
+{
+	int mask = atomic_xchg(&s->wake_mask, 0);
+	int i;
+
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		/* Pairs with the barrier in prepare_to_wait() */
+		if (!(mask & (1 << i)) || !wq_has_sleeper(&s->wq[i]))
+			continue;
+		lunix_stat_inc(LUNIX_STAT_WAKEUPS);
+		trace_lunix_sensor_wake(s->nodeid, i);
+		wake_up_interruptible(&s->wq[i]);
+	}
 }
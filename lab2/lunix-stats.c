@@ -0,0 +1,102 @@
+/*
+ * lunix-stats.c
+ *
+ * Ingest counters for Lunix:TNG,
+ * exported through debugfs as lunix/stats,
+ * and per TTY as lunix/<tty>
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "lunix.h"
+#include "lunix-stats.h"
+#include "lunix-protocol.h"
+
+DEFINE_PER_CPU(struct lunix_stats_struct, lunix_stats);
+
+static const char *const lunix_stat_names[N_LUNIX_STAT] = {
+	[LUNIX_STAT_BYTES]		= "bytes",
+	[LUNIX_STAT_FRAMES]		= "frames",
+	[LUNIX_STAT_CRC_ERRORS]		= "crc_errors",
+	[LUNIX_STAT_FRAMING_ERRORS]	= "framing_errors",
+	[LUNIX_STAT_IGNORED]		= "ignored",
+	[LUNIX_STAT_SENSOR_UPDATES]	= "sensor_updates",
+	[LUNIX_STAT_WAKEUPS]		= "wakeups",
+	[LUNIX_STAT_STREAM_DROPS]	= "stream_drops"
+};
+
+static struct dentry *lunix_stats_dir;
+
+/*
+ * Sums the counters over all CPUs. The result is not an atomic
+ * snapshot, but each counter only ever goes up.
+ */
+static int lunix_stats_show(struct seq_file *m, void *v)
+{
+	unsigned long sum;
+	int i, cpu;
+
+	for (i = 0; i < N_LUNIX_STAT; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += per_cpu(lunix_stats, cpu).cnt[i];
+		seq_printf(m, "%-16s%lu\n", lunix_stat_names[i], sum);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lunix_stats);
+
+/*
+ * The error counters of the protocol state machine of a single TTY.
+ * They are only updated by its parser, reading them racily is fine.
+ */
+static int lunix_stats_tty_show(struct seq_file *m, void *v)
+{
+	struct lunix_protocol_state_struct *state = m->private;
+
+	seq_printf(m, "%-16s%lu\n", "crc_errors", READ_ONCE(state->crc_errors));
+	seq_printf(m, "%-16s%lu\n", "framing_errors", READ_ONCE(state->framing_errors));
+	seq_printf(m, "%-16s%lu\n", "ignored", READ_ONCE(state->ignored_packets));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lunix_stats_tty);
+
+/*
+ * Failing to create the debugfs entries is not fatal,
+ * debugfs may well be disabled, or not mounted.
+ */
+int lunix_stats_init(void)
+{
+	lunix_stats_dir = debugfs_create_dir("lunix", NULL);
+	debugfs_create_file("stats", 0444, lunix_stats_dir, NULL, &lunix_stats_fops);
+	return 0;
+}
+
+/*
+ * Exports the counters of the line discipline on a TTY, for as long
+ * as it is set on it. The result is only meant for lunix_stats_tty_remove().
+ */
+struct dentry *lunix_stats_tty_create(const char *name, struct lunix_protocol_state_struct *state)
+{
+	return debugfs_create_file(name, 0444, lunix_stats_dir, state, &lunix_stats_tty_fops);
+}
+
+/*
+ * Waits for any readers still in lunix_stats_tty_show(),
+ * the protocol state may be freed once this returns.
+ */
+void lunix_stats_tty_remove(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+}
+
+void lunix_stats_destroy(void)
+{
+	debugfs_remove_recursive(lunix_stats_dir);
+}
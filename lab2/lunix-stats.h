@@ -0,0 +1,56 @@
+/*
+ * lunix-stats.h
+ *
+ * Definition file for the
+ * Lunix:TNG ingest counters
+ *
+ */
+
+#ifndef _LUNIX_STATS_H
+#define _LUNIX_STATS_H
+
+#ifdef __KERNEL__
+
+#include <linux/percpu.h>
+
+/*
+ * Counters kept along the ingest path, from bytes received
+ * on the TTYs to readers woken up. They are per-CPU, so that
+ * updating them costs a single instruction and no locking,
+ * and are only summed up when read through debugfs.
+ */
+enum lunix_stat_enum {
+	LUNIX_STAT_BYTES = 0,		/* Bytes received on all TTYs */
+	LUNIX_STAT_FRAMES,		/* Packets received and handled */
+	LUNIX_STAT_CRC_ERRORS,		/* Packets dropped due to a bad CRC */
+	LUNIX_STAT_FRAMING_ERRORS,	/* Packets dropped due to overflow or a missing end byte */
+	LUNIX_STAT_IGNORED,		/* Packets of AM types nobody handles */
+	LUNIX_STAT_SENSOR_UPDATES,	/* Measurements stored for a sensor */
+	LUNIX_STAT_WAKEUPS,		/* Wakeups issued to readers of a measurement */
+	LUNIX_STAT_STREAM_DROPS,	/* Samples dropped from full queues of streaming readers */
+	N_LUNIX_STAT
+};
+
+struct lunix_stats_struct {
+	unsigned long cnt[N_LUNIX_STAT];
+};
+
+DECLARE_PER_CPU(struct lunix_stats_struct, lunix_stats);
+
+#define lunix_stat_inc(i)	this_cpu_inc(lunix_stats.cnt[i])
+#define lunix_stat_add(i, n)	this_cpu_add(lunix_stats.cnt[i], n)
+
+struct dentry;
+struct lunix_protocol_state_struct;
+
+/*
+ * Function prototypes
+ */
+int lunix_stats_init(void);
+void lunix_stats_destroy(void);
+struct dentry *lunix_stats_tty_create(const char *name, struct lunix_protocol_state_struct *state);
+void lunix_stats_tty_remove(struct dentry *dentry);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_STATS_H */
@@ -0,0 +1,133 @@
+/*
+ * lunix-trace.h
+ *
+ * Tracepoints along the Lunix:TNG ingest path, from bytes
+ * received on a TTY to readers woken up, e.g.
+ *
+ *	perf trace -e 'lunix:*'
+ *
+ * or through /sys/kernel/tracing/events/lunix/. They cost next
+ * to nothing while disabled, so they are always built in.
+ *
+ * lunix-module.c defines CREATE_TRACE_POINTS before including this.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lunix
+
+#if !defined(_LUNIX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LUNIX_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Reasons for dropping a packet, as reported by lunix_frame_drop */
+#define LUNIX_DROP_CRC		0	/* Bad CRC */
+#define LUNIX_DROP_FRAMING	1	/* Payload overflow or missing end byte */
+#define LUNIX_DROP_IGNORED	2	/* AM type nobody handles */
+
+TRACE_EVENT(lunix_receive,
+	TP_PROTO(const char *tty, int count),
+	TP_ARGS(tty, count),
+	TP_STRUCT__entry(
+		__string(tty, tty)
+		__field(int, count)
+	),
+	TP_fast_assign(
+		__assign_str(tty, tty);
+		__entry->count = count;
+	),
+	TP_printk("tty=%s count=%d", __get_str(tty), __entry->count)
+);
+
+TRACE_EVENT(lunix_frame_start,
+	TP_PROTO(const void *state),
+	TP_ARGS(state),
+	TP_STRUCT__entry(
+		__field(const void *, state)
+	),
+	TP_fast_assign(
+		__entry->state = state;
+	),
+	TP_printk("state=%p", __entry->state)
+);
+
+TRACE_EVENT(lunix_frame_complete,
+	TP_PROTO(const void *state, int am_type, int payload_length),
+	TP_ARGS(state, am_type, payload_length),
+	TP_STRUCT__entry(
+		__field(const void *, state)
+		__field(int, am_type)
+		__field(int, payload_length)
+	),
+	TP_fast_assign(
+		__entry->state = state;
+		__entry->am_type = am_type;
+		__entry->payload_length = payload_length;
+	),
+	TP_printk("state=%p am_type=0x%02x payload_length=%d",
+		__entry->state, __entry->am_type, __entry->payload_length)
+);
+
+TRACE_EVENT(lunix_frame_drop,
+	TP_PROTO(const void *state, int reason),
+	TP_ARGS(state, reason),
+	TP_STRUCT__entry(
+		__field(const void *, state)
+		__field(int, reason)
+	),
+	TP_fast_assign(
+		__entry->state = state;
+		__entry->reason = reason;
+	),
+	TP_printk("state=%p reason=%s", __entry->state,
+		__print_symbolic(__entry->reason,
+			{ LUNIX_DROP_CRC, "crc" },
+			{ LUNIX_DROP_FRAMING, "framing" },
+			{ LUNIX_DROP_IGNORED, "ignored" }))
+);
+
+TRACE_EVENT(lunix_sensor_update,
+	TP_PROTO(int nodeid, uint16_t batt, uint16_t temp, uint16_t light),
+	TP_ARGS(nodeid, batt, temp, light),
+	TP_STRUCT__entry(
+		__field(int, nodeid)
+		__field(uint16_t, batt)
+		__field(uint16_t, temp)
+		__field(uint16_t, light)
+	),
+	TP_fast_assign(
+		__entry->nodeid = nodeid;
+		__entry->batt = batt;
+		__entry->temp = temp;
+		__entry->light = light;
+	),
+	TP_printk("nodeid=%d batt=0x%04x temp=0x%04x light=0x%04x",
+		__entry->nodeid, __entry->batt, __entry->temp, __entry->light)
+);
+
+TRACE_EVENT(lunix_sensor_wake,
+	TP_PROTO(int nodeid, int type),
+	TP_ARGS(nodeid, type),
+	TP_STRUCT__entry(
+		__field(int, nodeid)
+		__field(int, type)
+	),
+	TP_fast_assign(
+		__entry->nodeid = nodeid;
+		__entry->type = type;
+	),
+	TP_printk("nodeid=%d type=%s", __entry->nodeid,
+		__print_symbolic(__entry->type,
+			{ 0, "batt" },
+			{ 1, "temp" },
+			{ 2, "light" }))
+);
+
+#endif	/* _LUNIX_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lunix-trace
+#include <trace/define_trace.h>
@@ -0,0 +1,204 @@
+/*
+ * lunix-xmesh-gen.c
+ *
+ * Generates synthetic XMesh sensor traffic for Lunix:TNG on a
+ * pseudo-terminal, so that the driver can be tested and loaded
+ * without a real base station:
+ *
+ *	./lunix-xmesh-gen -n 16 -r 1000 &
+ *	./lunix-attach /dev/pts/N
+ *
+ * where /dev/pts/N is the slave side reported on startup.
+ * Output can also go to a file, for lunix-proto-bench -f.
+ *
+ */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "lunix-xmesh.h"
+
+/* Packets are written out in batches, once per tick */
+#define TICK_NS		1000000L
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Opens a new pseudo-terminal and returns the fd of its master side.
+ * The slave side is kept open in raw mode, so that the TTY survives
+ * lunix-attach coming and going.
+ */
+static int pty_open(void)
+{
+	struct termios tio;
+	int master, slave;
+	char *name;
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	if (grantpt(master) < 0 || unlockpt(master) < 0 || !(name = ptsname(master))) {
+		perror("pty setup");
+		return -1;
+	}
+	if ((slave = open(name, O_RDWR | O_NOCTTY)) < 0) {
+		perror(name);
+		return -1;
+	}
+	if (tcgetattr(slave, &tio) < 0) {
+		perror("tcgetattr");
+		return -1;
+	}
+	cfmakeraw(&tio);
+	if (tcsetattr(slave, TCSANOW, &tio) < 0) {
+		perror("tcsetattr");
+		return -1;
+	}
+
+	fprintf(stderr, "Generating XMesh traffic on %s\n", name);
+	return master;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t cnt)
+{
+	ssize_t ret;
+
+	while (cnt > 0) {
+		ret = write(fd, buf, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		buf += ret;
+		cnt -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Flips a random bit of a random byte in the packet
+ */
+static void corrupt(unsigned char *pkt, int len)
+{
+	pkt[rand() % len] ^= 1 << (rand() % 8);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-n nodes] [-r rate] [-e prob] [-c count] [-o file]\n\n"
+		"Generate XMesh 0x0B sensor packets on a new pseudo-terminal.\n"
+		"  -n nodes  number of node ids, reported round-robin from 1 [16]\n"
+		"  -r rate   target packets per second [100]\n"
+		"  -e prob   probability of a bit flip in each packet [0]\n"
+		"  -c count  stop after this many packets, 0 for never [0]\n"
+		"  -o file   write to file instead of a pseudo-terminal,\n"
+		"            as fast as possible, '-' for standard output\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int nodes = 16, fd, opt;
+	double rate = 100, prob = 0;
+	unsigned long count = 0, sent = 0, corrupted = 0, due;
+	unsigned long last_sent = 0;
+	const char *path = NULL;
+	unsigned char *buf;
+	double t0, t, last_report;
+	struct timespec tick;
+	size_t len;
+	int n;
+
+	while ((opt = getopt(argc, argv, "n:r:e:c:o:")) != -1) {
+		switch (opt) {
+		case 'n': nodes = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'e': prob = atof(optarg); break;
+		case 'c': count = strtoul(optarg, NULL, 0); break;
+		case 'o': path = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || nodes <= 0 || nodes > 0xFFFF || rate <= 0 || prob < 0 || prob > 1)
+		usage(argv[0]);
+
+	if (!path)
+		fd = pty_open();
+	else if (!strcmp(path, "-"))
+		fd = 1;
+	else if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		perror(path);
+	if (fd < 0)
+		return 1;
+
+	/* Enough room for a whole tick's worth of packets, at least one */
+	n = (int)(rate * TICK_NS / 1e9) + 1;
+	if (path && n < 1024)
+		n = 1024;
+	if (!(buf = malloc((size_t)n * XMESH_MAX_ENCODED_LEN))) {
+		perror("malloc");
+		return 1;
+	}
+
+	srand(time(NULL));
+	t0 = last_report = now();
+	tick.tv_sec = 0;
+	tick.tv_nsec = TICK_NS;
+
+	while (!count || sent < count) {
+		/* Files get packets as fast as possible, the pty at the given rate */
+		due = path ? sent + n : (unsigned long)((now() - t0) * rate);
+		if (due > sent + n)
+			due = sent + n;
+		if (count && due > count)
+			due = count;
+
+		for (len = 0; sent < due; sent++) {
+			int plen = xmesh_encode_sensor_packet(&buf[len], 1 + sent % nodes,
+				380 + rand() % 64, 480 + rand() % 64, rand() % 1024);
+
+			if (prob > 0 && rand() < prob * ((double)RAND_MAX + 1)) {
+				corrupt(&buf[len], plen);
+				corrupted++;
+			}
+			len += plen;
+		}
+		if (write_all(fd, buf, len) < 0)
+			return 1;
+
+		if (!path) {
+			t = now();
+			if (t - last_report >= 1.0) {
+				fprintf(stderr, "%lu packets sent, %lu corrupted, %.0f packets/s\n",
+					sent, corrupted, (sent - last_sent) / (t - last_report));
+				last_sent = sent;
+				last_report = t;
+			}
+			nanosleep(&tick, NULL);
+		}
+	}
+
+	fprintf(stderr, "%lu packets sent, %lu corrupted\n", sent, corrupted);
+	return 0;
+}
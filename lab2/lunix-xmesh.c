@@ -0,0 +1,79 @@
+/*
+ * lunix-xmesh.c
+ *
+ * Encoding of XMesh packets, for the userspace
+ * tools that generate test traffic for Lunix:TNG.
+ *
+ * The packet structure is described in lunix-protocol.c.
+ *
+ */
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "lunix-xmesh.h"
+
+/*
+ * CRC-16-CCITT over the packet bytes between the start byte
+ * and the CRC, bit by bit. Deliberately independent of the
+ * table-driven implementation in lunix-protocol.c.
+ */
+uint16_t xmesh_crc16(const unsigned char *p, int len)
+{
+	uint16_t crc = 0;
+	int bit;
+
+	while (len--) {
+		crc ^= *p++ << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+/*
+ * Encodes a 0x0B sensor packet for nodeid into out, which must hold
+ * at least XMESH_MAX_ENCODED_LEN bytes. Returns the number of bytes
+ * written.
+ */
+int xmesh_encode_sensor_packet(unsigned char *out, uint16_t nodeid,
+	uint16_t batt, uint16_t temp, uint16_t light)
+{
+	unsigned char pkt[MAX_PACKET_LEN];
+	int i, len, n = 0;
+
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0] = 0x7E;			/* Start byte */
+	pkt[1] = 0x42;			/* Packet type */
+	put_le16(&pkt[2], 0xFFFF);	/* Destination address */
+	pkt[PACKET_SIGNATURE_OFFSET] = 0x0B;	/* AM type */
+	pkt[5] = 0x7D;			/* AM group */
+	pkt[6] = XMESH_SENSOR_PAYLOAD_LEN;
+	put_le16(&pkt[NODE_OFFSET], nodeid);
+	put_le16(&pkt[VREF_OFFSET], batt);
+	put_le16(&pkt[TEMPERATURE_OFFSET], temp);
+	put_le16(&pkt[LIGHT_OFFSET], light);
+	len = 7 + XMESH_SENSOR_PAYLOAD_LEN;
+	put_le16(&pkt[len], xmesh_crc16(&pkt[1], len - 1));
+	len += 2;
+
+	/* Start byte and packet type go out as they are, the rest escaped */
+	out[n++] = pkt[0];
+	out[n++] = pkt[1];
+	for (i = 2; i < len; i++) {
+		if (pkt[i] == 0x7E || pkt[i] == 0x7D) {
+			out[n++] = 0x7D;
+			out[n++] = pkt[i] ^ 0x20;
+		} else
+			out[n++] = pkt[i];
+	}
+	out[n++] = 0x7E;		/* End byte */
+
+	return n;
+}
@@ -0,0 +1,27 @@
+/*
+ * lunix-xmesh.h
+ *
+ * Encoding of XMesh packets, for the userspace
+ * tools that generate test traffic for Lunix:TNG.
+ *
+ */
+
+#ifndef _LUNIX_XMESH_H
+#define _LUNIX_XMESH_H
+
+#include <inttypes.h>
+
+#include "lunix-protocol.h"
+
+/*
+ * Payload length of the generated 0x0B sensor packets, and
+ * the largest a packet can get once escaped for transmission
+ */
+#define XMESH_SENSOR_PAYLOAD_LEN	29
+#define XMESH_MAX_ENCODED_LEN		(2 * MAX_PACKET_LEN)
+
+uint16_t xmesh_crc16(const unsigned char *p, int len);
+int xmesh_encode_sensor_packet(unsigned char *out, uint16_t nodeid,
+	uint16_t batt, uint16_t temp, uint16_t light);
+
+#endif	/* _LUNIX_XMESH_H */
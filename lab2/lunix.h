@@ -12,23 +12,58 @@
 
 /* Compile-time parameters */
 #define LUNIX_VERSION_STRING	"0.1701-D"
+#define LUNIX_AGG_NR_WINDOWS	3	/* Number of windows aggregates are kept over */
 
 #ifdef __KERNEL__ 
 
 #include <linux/fs.h>
 #include <linux/tty.h>
+#include <linux/list.h>
+#include <linux/kfifo.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/xarray.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
 
 /*
  * A structure representing a hardware sensor
- * and pages holding the most recent measurements received
+ * and pages holding the most recent measurements received.
+ * Sensors are allocated on demand, see lunix_sensor_get_or_create().
  */
 
 #define LUNIX_MSR_MAGIC 0xF00DF00D
 
 enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
+
+/* Longest text form of a measurement, see lunix_msr_format() */
+#define LUNIX_MSR_TEXT_MAX	26	/* "-", 20 digits, ".ddd\n" */
+
+/*
+ * The most recent sample of a measurement, as read by lunix_sensor_snapshot()
+ */
+struct lunix_msr_snapshot {
+	uint64_t seq;
+	uint64_t timestamp_ns;
+	uint32_t timestamp;
+	uint32_t value;                 /* Raw */
+};
+
+/*
+ * Running aggregates of a measurement over a window of time,
+ * in thousandths of its unit
+ */
+struct lunix_agg_struct {
+	uint32_t start;                 /* Start of the window, as last_update */
+	uint32_t count;                 /* Number of samples, the rest are only valid if non-zero */
+	int32_t min;
+	int32_t max;
+	int64_t sum;
+};
+
 struct lunix_sensor_struct {
+	unsigned int nodeid;
+
 	/*
 	 * A number of pages, one for each measurement.
 	 * They can be mapped to userspace.
@@ -36,25 +71,81 @@ struct lunix_sensor_struct {
 	struct lunix_msr_data_struct *msr_data[N_LUNIX_MSR];
 
 	/*
-	 * Spinlock used to assert mutual exclusion between
-	 * the serial line discipline and the character device driver
+	 * Seqlock protecting the measurements. Its spinlock asserts
+	 * mutual exclusion between the line disciplines of different
+	 * TTYs reporting on the same sensor, while the character device
+	 * driver only reads, retrying if an update got in the way.
+	 * Readers never delay the writer.
 	 */
-	spinlock_t lock;
+	seqlock_t lock;
+
+	/*
+	 * Lists of processes waiting to be woken up when
+	 * each measurement of this sensor has been updated with new data,
+	 * and a mask of the measurements with wakeups pending
+	 */
+	wait_queue_head_t wq[N_LUNIX_MSR];
+	atomic_t wake_mask;
 
 	/*
-	 * A list of processes waiting to be woken up
-	 * when this sensor has been updated with new data
+	 * Aggregates of each measurement over each of the windows in
+	 * lunix_agg_windows[], for the window in progress and the last
+	 * one with any samples in it. Protected by the seqlock.
 	 */
-	wait_queue_head_t wq;
+	struct lunix_agg_struct agg[N_LUNIX_MSR][LUNIX_AGG_NR_WINDOWS];
+	struct lunix_agg_struct agg_prev[N_LUNIX_MSR][LUNIX_AGG_NR_WINDOWS];
+
+	/*
+	 * Generation of the last update, from lunix_sensors_gen.
+	 * Protected by the seqlock.
+	 */
+	uint64_t gen;
+
+	/*
+	 * Queues of readers in streaming mode, each getting every
+	 * sample of one measurement. The list is protected by the
+	 * seqlock, only ever walked by its writers.
+	 */
+	struct list_head streams;
+};
+
+/*
+ * A bounded queue of samples of a measurement, for a single reader
+ * in streaming mode, filled by lunix_sensor_update(). When full,
+ * either the oldest sample queued or the newest one is dropped,
+ * and counted.
+ */
+struct lunix_stream_struct {
+	struct list_head list;          /* On the streams of the sensor */
+	enum lunix_msr_enum type;
+	int drop_newest;                /* Overflow policy */
+
+	/*
+	 * Taken by both sides: the writer dropping the oldest
+	 * sample moves the read end of the fifo
+	 */
+	spinlock_t lock;
+	DECLARE_KFIFO_PTR(fifo, struct lunix_msr_snapshot);
+	uint64_t drops;
 };
 
 /*
- * The default value for the maximum number of sensors supported
+ * The default value for the highest node id supported. Node ids may be
+ * sparse, only sensors actually heard from or opened take up memory.
  */
 #define LUNIX_SENSOR_CNT			16
 extern int lunix_sensor_cnt;
-extern struct lunix_sensor_struct *lunix_sensors;
-extern struct lunix_protocol_state_struct lunix_protocol_state;
+extern int lunix_crc_check;
+extern int lunix_ldisc_deferred;
+extern int lunix_ldisc_hiwat;
+extern int lunix_ldisc_lowat;
+extern struct xarray lunix_sensors;	/* Indexed by node id */
+extern int lunix_fleet;
+extern int lunix_wake_on_change;
+extern int lunix_agg_windows[LUNIX_AGG_NR_WINDOWS];
+extern struct lunix_fleet_entry *lunix_fleet_entries;	/* NULL unless lunix_fleet is set */
+extern atomic64_t lunix_sensors_gen;	/* Bumped on every update of any sensor */
+extern int lunix_stream_len;
 
 /*
  * Debugging
@@ -69,23 +160,145 @@ extern struct lunix_protocol_state_struct lunix_protocol_state;
 /*
  * Function prototypes
  */
+struct lunix_all_entry;
+
 int lunix_sensor_init(struct lunix_sensor_struct *);
 void lunix_sensor_destroy(struct lunix_sensor_struct *);
+struct lunix_sensor_struct *lunix_sensor_get_or_create(unsigned int nodeid);
+void lunix_sensors_destroy(void);
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light);
+void lunix_sensor_wake(struct lunix_sensor_struct *s);
+void lunix_sensor_snapshot(struct lunix_sensor_struct *s, enum lunix_msr_enum type,
+	struct lunix_msr_snapshot *snap);
+uint64_t lunix_sensor_seq(struct lunix_sensor_struct *s, enum lunix_msr_enum type);
+void lunix_sensor_aggregates(struct lunix_sensor_struct *s, enum lunix_msr_enum type,
+	struct lunix_agg_struct *agg, struct lunix_agg_struct *agg_prev);
+long lunix_msr_convert(enum lunix_msr_enum type, uint32_t data);
+int lunix_msr_format(char *buf, long value);
+int lunix_sensor_all_entry(struct lunix_sensor_struct *s, uint64_t since,
+	struct lunix_all_entry *e);
+struct lunix_stream_struct *lunix_stream_create(enum lunix_msr_enum type, unsigned int len);
+void lunix_stream_destroy(struct lunix_stream_struct *st);
+void lunix_stream_attach(struct lunix_sensor_struct *s, struct lunix_stream_struct *st);
+void lunix_stream_detach(struct lunix_sensor_struct *s, struct lunix_stream_struct *st);
+unsigned int lunix_stream_out(struct lunix_stream_struct *st,
+	struct lunix_msr_snapshot *snaps, unsigned int n);
+uint64_t lunix_stream_drops(struct lunix_stream_struct *st);
+int lunix_fleet_init(void);
+void lunix_fleet_destroy(void);
+
+/*
+ * Returns the sensor for a node id, or NULL if it has not been
+ * allocated yet. Lockless, safe to call from any context.
+ */
+static inline struct lunix_sensor_struct *lunix_sensor_get(unsigned int nodeid)
+{
+	return xa_load(&lunix_sensors, nodeid);
+}
 
 #else
 #include <inttypes.h>
 #endif	/* __KERNEL__ */
 /*
- * A structure, living at the start of a page, containing a version number
- * [timestamp of last update] and a variable number of 32-bit quantities. It is
- * meant to be mappable to userspace.
+ * A structure, filling 1 << LUNIX_MSR_ORDER pages, containing a version number
+ * [sequence number and timestamp of last update] and a ring of the last
+ * LUNIX_MSR_HIST_LEN samples, each a raw 16-bit value along with the time
+ * [in seconds] it was received. It is meant to be mappable to userspace.
+ *
+ * The most recent sample is at slot (head + LUNIX_MSR_HIST_LEN - 1) %
+ * LUNIX_MSR_HIST_LEN. seq counts all samples ever stored, so a reader
+ * can tell how many it has missed, and whether they are still in the ring.
+ * Unlike last_update, it changes with every sample, however close together.
+ *
+ * The buffer is being updated while sequence is odd. Mapped readers
+ * read sequence, then head, seq and the samples they want, then sequence
+ * again, with read barriers in between, and retry if the two reads
+ * of sequence differ or are odd. Checking seq instead is not enough,
+ * as it only changes once the oldest slot has been overwritten.
  */
+#define LUNIX_MSR_ORDER		1
+#define LUNIX_MSR_HIST_LEN	1020
+
 struct lunix_msr_data_struct {
 	uint32_t magic;
 	uint32_t last_update;
-	uint32_t values[];
+	uint32_t head;                  /* Slot the next sample goes to */
+	uint32_t sequence;              /* Odd while being updated */
+	uint64_t seq;                   /* Number of samples stored so far */
+	uint64_t last_update_ns;        /* CLOCK_MONOTONIC time of last update, in ns */
+	uint32_t timestamps[LUNIX_MSR_HIST_LEN];
+	uint32_t values[LUNIX_MSR_HIST_LEN];
+};
+
+/*
+ * Alternative layout, for scanning the whole fleet of sensors at once:
+ * the latest measurements of all sensors packed in a single region,
+ * one cache line per sensor. It can be mapped read-only from
+ * /dev/lunix-fleet, when the module is loaded with lunix_fleet=1.
+ *
+ * The region starts with a struct lunix_fleet_header, padded to
+ * LUNIX_FLEET_ENTRY_SZ bytes, followed by an entry for each node id
+ * from 1 to nr_entries - 1, so the entry for node i is at offset
+ * LUNIX_FLEET_ENTRY_SZ * i. Entries for nodes never heard from are zero.
+ *
+ * An entry is being updated while its sequence is odd. Readers copy
+ * it out between two reads of sequence, with read barriers in between,
+ * and retry if those differ or are odd.
+ */
+#define LUNIX_FLEET_MAGIC	0xF1EE7000
+#define LUNIX_FLEET_ENTRY_SZ	64
+
+struct lunix_fleet_header {
+	uint32_t magic;
+	uint32_t nr_entries;            /* Including the header */
+};
+
+struct lunix_fleet_entry {
+	uint32_t sequence;
+	uint32_t nodeid;
+	uint32_t batt;                  /* Raw 16-bit values, as in lunix_msr_data_struct */
+	uint32_t temp;
+	uint32_t light;
+	uint32_t last_update;
+	uint64_t seq;
+	uint64_t last_update_ns;
+} __attribute__((aligned(LUNIX_FLEET_ENTRY_SZ)));
+
+/*
+ * Yet another way to scan the whole fleet, without mapping anything:
+ * every read() of /dev/lunix-all returns a struct lunix_all_header,
+ * followed by an entry for each sensor updated after generation *f_pos,
+ * in one go. Generations count updates of any sensor, starting from 1,
+ * so at position 0 every sensor heard from is returned.
+ *
+ * Each read moves the file position on to the generation in the header,
+ * so that the next one returns only what changed since. A sensor updated
+ * while the read was in progress may be returned twice, never missed.
+ * Seek, or pread(), to 0 or any generation seen before to go back.
+ *
+ * If the buffer cannot hold all entries, LUNIX_ALL_TRUNCATED is set
+ * and the position is left as it was, so that the read can be retried
+ * with a larger one. Buffers smaller than the header get EINVAL.
+ */
+#define LUNIX_ALL_MAGIC		0xA11DA7A0
+#define LUNIX_ALL_TRUNCATED	0x0001
+
+struct lunix_all_header {
+	uint32_t magic;
+	uint32_t nr_entries;            /* Number of entries that follow */
+	uint32_t flags;
+	uint32_t reserved;
+	uint64_t gen;                   /* Latest generation, as of the read */
+};
+
+struct lunix_all_entry {
+	uint64_t gen;                   /* Generation of the last update */
+	uint64_t last_update_ns;
+	uint32_t nodeid;
+	uint32_t last_update;
+	uint32_t raw[3];                /* Raw 16-bit values, battery, temperature, light */
+	int32_t value[3];               /* In thousandths of the unit of each measurement */
 };
 
 /*
@@ -2,8 +2,9 @@
  * mk_lookup_tables.c
  *
  * Computes the temperature and battery
- * lookup tables for converting 16-bit raw measurements
- * from the wireless sensors to actual floating point values.
+ * lookup tables for converting raw measurements
+ * from the wireless sensors to actual floating point values,
+ * and a table of decimal digits for formatting them as text.
  *
  * Ioannis Panagopoulos <ioannis@cslab.ece.ntua.gr>
  * Vangelis Koukis <vkoukis@cslab.ece.ntua.gr>
@@ -12,8 +13,12 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 
+/* Number of values of the 10-bit ADC, see ADC_FS below */
+#define LOOKUP_ADC_SZ	1024
+
 /*
  * Translates the received uint16_t value to voltage level
  */
@@ -66,57 +71,91 @@ long uint16_to_temp(uint16_t value)
 	return (l < -272150) ?  -272150 : l;
 }
 
-int main(void)
+/*
+ * Prints the table decl, of conv(i) for every i from 0 to n - 1
+ */
+static void print_table(const char *decl, long (*conv)(uint16_t), unsigned int n)
+{
+	unsigned int i;
+
+	fprintf(stdout, "%s = {\n", decl);
+	for (i = 0; i < n; i += 4) {
+		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
+			conv(i), conv(i+1), conv(i+2), conv(i+3));
+		fprintf(stdout, (i != n - 4) ? ",\n" : "\n");
+	}
+	fprintf(stdout, "};\n\n");
+}
+
+int main(int argc, char *argv[])
 {
 	unsigned int i;
+	int legacy = (argc == 2 && !strcmp(argv[1], "-l"));
+
+	if (argc > 1 && !legacy) {
+		fprintf(stderr, "Usage: %s [-l]\n\n"
+			"Print the lookup tables for lunix-lookup.h, or with -l the\n"
+			"original ones, covering all 16-bit raw values, for comparison.\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (legacy) {
+		fprintf(stdout,
+			"/*\n"
+			" * lunix-lookup-legacy.h\n"
+			" *\n"
+			" * Machine-generated file. DO NOT EDIT.\n"
+			" * See %s instead.\n"
+			" *\n"
+			" * The original lookup tables, with a long for each\n"
+			" * 16-bit raw value, for lunix-convert-bench to compare\n"
+			" * the ones in lunix-lookup.h against.\n"
+			" */\n"
+			"\n", __FILE__);
+		print_table("long lookup_legacy_temperature[65536]", uint16_to_temp, 0x10000);
+		print_table("long lookup_legacy_voltage[65536]", uint16_to_batt, 0x10000);
+		print_table("long lookup_legacy_light[65536]", uint16_to_light, 0x10000);
+		return 0;
+	}
 
 	fprintf(stdout,
 		"/*\n"
-		" * lunix-tables.h\n"
+		" * lunix-lookup.h\n"
 		" *\n"
 		" * Machine-generated file. DO NOT EDIT.\n"
 		" * See %s instead.\n"
 		" *\n"
 		" * Instead of doing floating-point in kernelspace,\n"
-		" * use the following lookup tables to convert 16-bit\n"
-		" * raw measurements to floating point values.\n"
+		" * use the following lookup tables to convert raw\n"
+		" * measurements to thousandths of their unit.\n"
+		" *\n"
+		" * Battery voltage and temperature come from a 10-bit ADC,\n"
+		" * so only raw values below LOOKUP_ADC_SZ are covered.\n"
+		" * Light is linear, and needs no table.\n"
 		" */\n"
 		"\n"
-		"long lookup_temperature[65536] = {\n", __FILE__);
+		"#define LOOKUP_ADC_SZ %d\n"
+		"\n", __FILE__, LOOKUP_ADC_SZ);
 
-	/*
-	 * Temperature
-	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-			uint16_to_temp(i), uint16_to_temp(i+1),
-			uint16_to_temp(i+2), uint16_to_temp(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-
-	fprintf(stdout, "};\n\n"
-		"long lookup_voltage[65536] = {\n");
+	print_table("static const int32_t lookup_temperature[LOOKUP_ADC_SZ]", uint16_to_temp, LOOKUP_ADC_SZ);
+	print_table("static const int32_t lookup_voltage[LOOKUP_ADC_SZ]", uint16_to_batt, LOOKUP_ADC_SZ);
 
-	/*
-	 * Battery Voltage
-	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-			uint16_to_batt(i), uint16_to_batt(i+1),
-			uint16_to_batt(i+2), uint16_to_batt(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-	fprintf(stdout, "};\n\n"
-		"long lookup_light[65536] = {\n");
+	fprintf(stdout,
+		"/*\n"
+		" * Three-digit, zero-padded decimal forms of 0 to 999,\n"
+		" * so that values can be formatted as text by copying\n"
+		" * digits three at a time.\n"
+		" */\n"
+		"static const char lookup_digits[1000][4] = {\n");
 
 	/*
-	 * Light
+	 * Decimal digits
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-			uint16_to_light(i), uint16_to_light(i+1),
-			uint16_to_light(i+2), uint16_to_light(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
+	for (i = 0; i < 1000; i += 8) {
+		fprintf(stdout, "\t\"%03u\", \"%03u\", \"%03u\", \"%03u\", \"%03u\", \"%03u\", \"%03u\", \"%03u\"",
+			i, i+1, i+2, i+3, i+4, i+5, i+6, i+7);
+		fprintf(stdout, (i != 992) ? ",\n" : "\n");
 	}
 
 	fprintf(stdout, "};\n\n");
@@ -0,0 +1,383 @@
+/*
+ * lunix-uspace.h
+ *
+ * Thin userspace replacements for the kernel APIs used by
+ * lunix-protocol.c and lunix-sensors.c, so that they can be built
+ * and exercised as ordinary programs, e.g. by lunix-proto-bench.
+ *
+ * All headers under uspace/linux and uspace/asm just include this file.
+ * Only meant for single-process testing and benchmarking.
+ */
+
+#ifndef _LUNIX_USPACE_H
+#define _LUNIX_USPACE_H
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+/*
+ * printk() and friends
+ */
+#define KERN_ERR		"<3>"
+#define KERN_WARNING		"<4>"
+#define KERN_INFO		"<6>"
+#define KERN_DEBUG		"<7>"
+#define printk(fmt, arg...)	fprintf(stderr, fmt, ##arg)
+
+/*
+ * Compiler and arithmetic helpers
+ */
+#define __read_mostly
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define min(x, y)		((x) < (y) ? (x) : (y))
+#define max(x, y)		((x) > (y) ? (x) : (y))
+#define min3(x, y, z)		min(min(x, y), z)
+#define min_t(type, x, y)	min((type)(x), (type)(y))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define BUILD_BUG_ON(cond)	_Static_assert(!(cond), #cond)
+#define READ_ONCE(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val)	__atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()		__builtin_ia32_pause()
+#else
+#define cpu_relax()		do { } while (0)
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define le16_to_cpu(x)		((uint16_t)(x))
+#else
+#define le16_to_cpu(x)		__builtin_bswap16(x)
+#endif
+
+/*
+ * Atomics
+ */
+typedef struct {
+	int counter;
+} atomic_t;
+
+#define atomic_set(v, i)	__atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_or(i, v)		__atomic_fetch_or(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_xchg(v, i)	__atomic_exchange_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+
+typedef struct {
+	int64_t counter;
+} atomic64_t;
+
+#define ATOMIC64_INIT(i)	{ (i) }
+#define atomic64_read(v)	__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic64_inc_return(v)	__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+
+/*
+ * Bit operations
+ */
+#define BITS_PER_LONG		(8 * sizeof(long))
+#define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+
+static inline void __set_bit(int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void __clear_bit(int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline int test_bit(int nr, const unsigned long *addr)
+{
+	return !!(addr[BIT_WORD(nr)] & BIT_MASK(nr));
+}
+
+#define for_each_set_bit(bit, addr, size) \
+	for ((bit) = 0; (bit) < (size); (bit)++) \
+		if (test_bit(bit, addr))
+
+/*
+ * Memory allocation
+ */
+#define GFP_KERNEL		0
+#define PAGE_SIZE		4096UL
+
+static inline void *kzalloc(size_t size, int flags)
+{
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+static inline unsigned long get_zeroed_page(int flags)
+{
+	void *p;
+
+	if (posix_memalign(&p, PAGE_SIZE, PAGE_SIZE))
+		return 0;
+	return (unsigned long)memset(p, 0, PAGE_SIZE);
+}
+
+static inline void free_page(unsigned long addr)
+{
+	free((void *)addr);
+}
+
+#define __GFP_ZERO		0
+
+static inline unsigned long __get_free_pages(int flags, unsigned int order)
+{
+	void *p;
+
+	if (posix_memalign(&p, PAGE_SIZE, PAGE_SIZE << order))
+		return 0;
+	return (unsigned long)memset(p, 0, PAGE_SIZE << order);
+}
+
+static inline void free_pages(unsigned long addr, unsigned int order)
+{
+	free((void *)addr);
+}
+
+/*
+ * XArrays, as a flat table covering 16-bit indices,
+ * allocated on first store
+ */
+#define XA_SHIM_SIZE		(1UL << 16)
+
+struct xarray {
+	void **slots;
+};
+
+#define DEFINE_XARRAY(name)	struct xarray name = { NULL }
+#define xa_is_err(entry)	0
+
+static inline void *xa_load(struct xarray *xa, unsigned long index)
+{
+	void **slots = __atomic_load_n(&xa->slots, __ATOMIC_ACQUIRE);
+
+	return (slots && index < XA_SHIM_SIZE) ? __atomic_load_n(&slots[index], __ATOMIC_ACQUIRE) : NULL;
+}
+
+static inline void *xa_cmpxchg(struct xarray *xa, unsigned long index,
+	void *old, void *entry, int flags)
+{
+	void **slots = __atomic_load_n(&xa->slots, __ATOMIC_ACQUIRE);
+	void **fresh;
+
+	if (!slots) {
+		if (!(fresh = calloc(XA_SHIM_SIZE, sizeof(void *))))
+			abort();
+		if (__atomic_compare_exchange_n(&xa->slots, &slots, fresh, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			slots = fresh;
+		else
+			free(fresh);
+	}
+	__atomic_compare_exchange_n(&slots[index], &old, entry, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	return old;
+}
+
+static inline void xa_destroy(struct xarray *xa)
+{
+	free(xa->slots);
+	xa->slots = NULL;
+}
+
+#define xa_for_each(xa, index, entry) \
+	for ((index) = 0; (index) < XA_SHIM_SIZE; (index)++) \
+		if (((entry) = xa_load(xa, index)))
+
+/*
+ * Linked lists
+ */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+	entry->next = head;
+	entry->prev = head->prev;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+#define list_empty(head)	((head)->next == (head))
+
+#define list_for_each_entry(pos, head, member) \
+	for ((pos) = container_of((head)->next, __typeof__(*(pos)), member); \
+	     &(pos)->member != (head); \
+	     (pos) = container_of((pos)->member.next, __typeof__(*(pos)), member))
+
+/*
+ * Fifos of fixed-size elements, only the typed interface
+ */
+#define DECLARE_KFIFO_PTR(fifo, type) \
+	struct { \
+		unsigned int in, out, mask; \
+		type *data; \
+	} fifo
+
+#define kfifo_alloc(fifo, size, gfp) ({ \
+	unsigned int __sz = 2; \
+	while (__sz < (size)) \
+		__sz <<= 1; \
+	(fifo)->in = (fifo)->out = 0; \
+	(fifo)->mask = __sz - 1; \
+	(fifo)->data = calloc(__sz, sizeof(*(fifo)->data)); \
+	(fifo)->data ? 0 : -ENOMEM; \
+})
+#define kfifo_free(fifo)	free((fifo)->data)
+#define kfifo_len(fifo)		((fifo)->in - (fifo)->out)
+#define kfifo_is_empty(fifo)	(kfifo_len(fifo) == 0)
+#define kfifo_is_full(fifo)	(kfifo_len(fifo) > (fifo)->mask)
+#define kfifo_skip(fifo)	((fifo)->out++)
+#define kfifo_reset(fifo)	((fifo)->in = (fifo)->out = 0)
+
+#define kfifo_put(fifo, val) ({ \
+	int __ok = !kfifo_is_full(fifo); \
+	if (__ok) \
+		(fifo)->data[(fifo)->in++ & (fifo)->mask] = (val); \
+	__ok; \
+})
+
+#define kfifo_out(fifo, buf, n) ({ \
+	unsigned int __i, __n = min_t(unsigned int, (n), kfifo_len(fifo)); \
+	for (__i = 0; __i < __n; __i++) \
+		(buf)[__i] = (fifo)->data[(fifo)->out++ & (fifo)->mask]; \
+	__n; \
+})
+
+/*
+ * Spinlocks
+ */
+typedef pthread_spinlock_t spinlock_t;
+
+#define spin_lock_init(lock)	pthread_spin_init(lock, PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(lock)		pthread_spin_lock(lock)
+#define spin_unlock(lock)	pthread_spin_unlock(lock)
+
+/*
+ * Seqlocks, on top of the above and GCC atomics
+ */
+typedef struct {
+	unsigned int sequence;
+	spinlock_t lock;
+} seqlock_t;
+
+#define seqlock_init(sl) \
+	((sl)->sequence = 0, spin_lock_init(&(sl)->lock))
+
+static inline void write_seqlock(seqlock_t *sl)
+{
+	spin_lock(&sl->lock);
+	WRITE_ONCE(sl->sequence, sl->sequence + 1);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_sequnlock(seqlock_t *sl)
+{
+	__atomic_store_n(&sl->sequence, sl->sequence + 1, __ATOMIC_RELEASE);
+	spin_unlock(&sl->lock);
+}
+
+static inline unsigned int read_seqbegin(const seqlock_t *sl)
+{
+	unsigned int seq;
+
+	while ((seq = __atomic_load_n(&sl->sequence, __ATOMIC_ACQUIRE)) & 1)
+		cpu_relax();
+	return seq;
+}
+
+static inline int read_seqretry(const seqlock_t *sl, unsigned int start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return READ_ONCE(sl->sequence) != start;
+}
+
+/*
+ * Wait queues: nobody ever sleeps, wakeups are only counted
+ */
+typedef struct {
+	unsigned long wakeups;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq)	((wq)->wakeups = 0)
+#define wq_has_sleeper(wq)	1
+#define wake_up_interruptible(wq) \
+	__atomic_fetch_add(&(wq)->wakeups, 1, __ATOMIC_RELAXED)
+
+/*
+ * Per-CPU data: there is only one CPU
+ */
+#define DECLARE_PER_CPU(type, name)	extern __typeof__(type) name
+#define DEFINE_PER_CPU(type, name)	__typeof__(type) name
+#define this_cpu_inc(pcp)		((pcp)++)
+#define this_cpu_add(pcp, val)		((pcp) += (val))
+
+/*
+ * Tracepoints: always disabled
+ */
+#define TP_PROTO(args...)		args
+#define TP_ARGS(args...)		args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+	static inline void trace_##name(proto) { }
+
+/*
+ * 64-bit division, native here
+ */
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+
+/*
+ * Time
+ */
+static inline unsigned long get_seconds(void)
+{
+	return time(NULL);
+}
+
+static inline u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif	/* _LUNIX_USPACE_H */
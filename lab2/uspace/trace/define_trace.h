@@ -0,0 +1 @@
+/* Nothing to define, tracepoints are compiled out in userspace */